@@ -0,0 +1,1357 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <new>
+#include <cstdlib>
+#include <thread>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+#include "path.h"
+
+// Benchmarks for the file system, run as ./fsbench <benchmark> [--mmap | --uring | --ram].
+// Every benchmark works on its own disk file, BENCH_DISKNAME.
+
+#define BENCH_DISKNAME "bench.bin"
+
+static int disk_backend = DISK_FSTREAM;
+
+// every heap allocation in the process, for the paths benchmark, and the
+// largest one, for the stream benchmark
+static uint64_t allocations = 0;
+static size_t largest_allocation = 0;
+
+// the operators stay out of line, inlined the compiler would pair the
+// malloc in one with the free in the other and warn about a mismatch
+__attribute__((noinline)) void *operator new(std::size_t n)
+{
+    allocations++;
+    if (n > largest_allocation)
+        largest_allocation = n;
+    void *p = malloc(n ? n : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept
+{
+    free(p);
+}
+
+// discards everything written to it, the file system is chatty
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+};
+
+// silences std::cout and std::cerr while it is in scope
+class Quiet
+{
+private:
+    NullBuffer null_buffer;
+    std::streambuf *cout_buffer;
+    std::streambuf *cerr_buffer;
+public:
+    Quiet() : cout_buffer(std::cout.rdbuf(&null_buffer)), cerr_buffer(std::cerr.rdbuf(&null_buffer)) {}
+    ~Quiet()
+    {
+        std::cout.rdbuf(cout_buffer);
+        std::cerr.rdbuf(cerr_buffer);
+    }
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// create reads the file content from std::cin, feed it from a string
+static int create_file(FS &fs, const std::string &path, const std::string &content)
+{
+    std::istringstream input(content + "\n");
+    std::streambuf *cin_buffer = std::cin.rdbuf(input.rdbuf());
+    int ret = fs.create(path);
+    std::cin.rdbuf(cin_buffer);
+    return ret;
+}
+
+// content made of lines of line_length characters, about size bytes in total
+static std::string make_content(size_t size, size_t line_length)
+{
+    std::string line(line_length, 'x');
+    std::string content;
+    while (content.size() + line_length + 1 <= size)
+        content += line + "\n";
+    return content;
+}
+
+// geometry compares block sizes on a small-file and a large-file workload
+static int bench_geometry()
+{
+    const unsigned disk_bytes = 16 << 20;
+    const unsigned block_sizes[] = {1024, 4096, 16384};
+    const int dirs = 10, files_per_dir = 10;
+    const std::string small_content = make_content(200, 49);
+    const std::string large_content = make_content(4 << 20, 999);
+
+    std::cout << "block size | small create | small cat | large create | large cat | large cp (ms)\n";
+    for (unsigned block_size : block_sizes)
+    {
+        double times[5];
+        {
+            Quiet quiet;
+            FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(disk_bytes / block_size, block_size) != 0)
+                return -1;
+
+            auto start = std::chrono::steady_clock::now();
+            for (int d = 0; d < dirs; ++d)
+            {
+                std::string dir = "d" + std::to_string(d);
+                fs.mkdir(dir);
+                for (int f = 0; f < files_per_dir; ++f)
+                    create_file(fs, dir + "/f" + std::to_string(f), small_content);
+            }
+            fs.sync();
+            times[0] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            for (int d = 0; d < dirs; ++d)
+                for (int f = 0; f < files_per_dir; ++f)
+                    fs.cat("d" + std::to_string(d) + "/f" + std::to_string(f));
+            times[1] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            create_file(fs, "large", large_content);
+            fs.sync();
+            times[2] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            fs.cat("large");
+            times[3] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            fs.cp("large", "large2");
+            fs.sync();
+            times[4] = elapsed_ms(start);
+        }
+        printf("%10u | %12.2f | %9.2f | %12.2f | %9.2f | %8.2f\n",
+               block_size, times[0], times[1], times[2], times[3], times[4]);
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// alloc compares the free-space bitmap with the old linear FAT scan
+// when allocating blocks on an image that is 10%, 50% and 95% full
+static int bench_alloc()
+{
+    const unsigned no_blocks = 1 << 20;
+    const unsigned fill_percent[] = {10, 50, 95};
+    const unsigned allocations = 20000;
+
+    std::cout << "fill | rebuild (ms) | bitmap (allocs/s) | linear scan (allocs/s)\n";
+    for (unsigned percent : fill_percent)
+    {
+        std::mt19937 rng(percent);
+        std::vector<int32_t> fat(no_blocks, FAT_FREE);
+        for (unsigned i = 0; i < no_blocks; ++i)
+        {
+            if (rng() % 100 < percent)
+                fat[i] = FAT_EOF;
+        }
+
+        // rebuild at mount
+        auto start = std::chrono::steady_clock::now();
+        FreeMap free_map;
+        free_map.reset(no_blocks);
+        for (unsigned i = 0; i < no_blocks; ++i)
+        {
+            if (fat[i] == FAT_FREE)
+                free_map.set_free(i);
+        }
+        double rebuild = elapsed_ms(start);
+
+        // every allocation searches from the start, as create and cp do
+        start = std::chrono::steady_clock::now();
+        for (unsigned n = 0; n < allocations; ++n)
+            free_map.set_used(free_map.find_free(0));
+        double bitmap = elapsed_ms(start);
+
+        start = std::chrono::steady_clock::now();
+        for (unsigned n = 0; n < allocations; ++n)
+        {
+            unsigned i = 0;
+            while (fat[i] != FAT_FREE)
+                i++;
+            fat[i] = FAT_EOF;
+        }
+        double linear = elapsed_ms(start);
+
+        printf("%3u%% | %12.2f | %17.0f | %22.0f\n", percent, rebuild,
+               allocations / bitmap * 1000, allocations / linear * 1000);
+    }
+    return 0;
+}
+
+// vector compares reading and writing a file block by block with the
+// vectored calls, on a contiguous and on a fragmented chain
+static int bench_vector()
+{
+    const unsigned no_blocks = 8192, block_size = 4096;
+    Disk *disk;
+    {
+        Quiet quiet;
+        disk = new Disk(disk_backend, BENCH_DISKNAME);
+        if (disk->resize(no_blocks, block_size) != 0)
+            return -1;
+    }
+    std::vector<uint8_t> buffer((size_t)CHAIN_BATCH_BLOCKS * block_size, 'x');
+    std::vector<uint8_t *> blks(CHAIN_BATCH_BLOCKS);
+    for (unsigned i = 0; i < CHAIN_BATCH_BLOCKS; ++i)
+        blks[i] = buffer.data() + (size_t)i * block_size;
+
+    std::cout << "chain      | op    | single calls | single (ms) | vector calls | vector (ms)\n";
+    for (int fragmented = 0; fragmented < 2; ++fragmented)
+    {
+        // a fragmented chain uses every other block, in runs of 4
+        std::vector<unsigned> chain;
+        for (unsigned b = 0; b < no_blocks; ++b)
+        {
+            if (!fragmented || (b / 4) % 2 == 0)
+                chain.push_back(b);
+        }
+        for (int write = 1; write >= 0; --write)
+        {
+            disk->reset_io_stats();
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned b : chain)
+            {
+                if (write)
+                    disk->write(b, blks[0]);
+                else
+                    disk->read(b, blks[0]);
+            }
+            double single = elapsed_ms(start);
+            uint64_t single_calls = disk->get_io_calls();
+
+            disk->reset_io_stats();
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < chain.size(); i += CHAIN_BATCH_BLOCKS)
+            {
+                std::vector<unsigned> batch(chain.begin() + i, chain.begin() + std::min(chain.size(), i + CHAIN_BATCH_BLOCKS));
+                std::vector<uint8_t *> batch_blks(blks.begin(), blks.begin() + batch.size());
+                if (write)
+                    disk->writev(batch, batch_blks);
+                else
+                    disk->readv(batch, batch_blks);
+            }
+            double vector = elapsed_ms(start);
+            uint64_t vector_calls = disk->get_io_calls();
+
+            printf("%-10s | %-5s | %12llu | %11.2f | %12llu | %11.2f\n",
+                   fragmented ? "fragmented" : "contiguous", write ? "write" : "read",
+                   (unsigned long long)single_calls, single, (unsigned long long)vector_calls, vector);
+        }
+    }
+    delete disk;
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// backends compares fstream, mmap, io_uring and the RAM disk on a large
+// file and on many small files, each phase ends with a sync. The RAM disk
+// shows what the file system itself costs.
+static int bench_backends()
+{
+    const int backends[] = {DISK_FSTREAM, DISK_MMAP, DISK_URING, DISK_RAM};
+    const char *names[] = {"fstream", "mmap", "uring", "ram"};
+    const std::string large_content = make_content(16 << 20, 999);
+    const std::string small_content = make_content(200, 49);
+    const int dirs = 10, files_per_dir = 50;
+
+    std::cout << "backend | large create | large cat | large cp | small create | small cat (ms)\n";
+    for (int b = 0; b < 4; ++b)
+    {
+        double times[5];
+        {
+            Quiet quiet;
+            FS fs(backends[b], CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(65536, 4096) != 0)
+                return -1;
+
+            auto start = std::chrono::steady_clock::now();
+            create_file(fs, "large", large_content);
+            fs.sync();
+            times[0] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            fs.cat("large");
+            times[1] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            fs.cp("large", "large2");
+            fs.sync();
+            times[2] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            for (int d = 0; d < dirs; ++d)
+            {
+                std::string dir = "d" + std::to_string(d);
+                fs.mkdir(dir);
+                for (int f = 0; f < files_per_dir; ++f)
+                    create_file(fs, dir + "/f" + std::to_string(f), small_content);
+            }
+            fs.sync();
+            times[3] = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            for (int d = 0; d < dirs; ++d)
+                for (int f = 0; f < files_per_dir; ++f)
+                    fs.cat("d" + std::to_string(d) + "/f" + std::to_string(f));
+            times[4] = elapsed_ms(start);
+        }
+        printf("%-7s | %12.2f | %9.2f | %8.2f | %12.2f | %9.2f\n",
+               names[b], times[0], times[1], times[2], times[3], times[4]);
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// dir creates, reads and removes n files in one directory, the cost per
+// operation should stay flat as n grows
+static int bench_dir()
+{
+    const unsigned sizes[] = {1000, 4000, 16000};
+    const unsigned lookups = 2000;
+    const std::string content = make_content(40, 39);
+
+    std::cout << "files | create (us/op) | cat (us/op) | rm (us/op) | dir blocks\n";
+    for (unsigned n : sizes)
+    {
+        double times[3];
+        unsigned dir_blocks;
+        {
+            Quiet quiet;
+            FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(65536, 4096) != 0)
+                return -1;
+            std::mt19937 rng(n);
+
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < n; ++i)
+                create_file(fs, "file" + std::to_string(i), content);
+            times[0] = elapsed_ms(start) * 1000 / n;
+            dir_blocks = fs.get_dir_blocks(ROOT_BLOCK);
+
+            start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < lookups; ++i)
+                fs.cat("file" + std::to_string(rng() % n));
+            times[1] = elapsed_ms(start) * 1000 / lookups;
+
+            start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < n; ++i)
+                fs.rm("file" + std::to_string(i));
+            times[2] = elapsed_ms(start) * 1000 / n;
+        }
+        printf("%5u | %14.2f | %11.2f | %10.2f | %10u\n", n, times[0], times[1], times[2], dir_blocks);
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// dentry resolves paths 16 directories deep with and without the dentry
+// cache, on top of the default block cache and with no block cache
+static int bench_dentry()
+{
+    const int depth = 16, files = 20, reads = 20000;
+    const unsigned cache_sizes[] = {CACHE_BLOCKS, 0};
+    const std::string content = make_content(40, 39);
+
+    std::cout << "block cache | dentries | cat (us/op)\n";
+    for (unsigned cache_blocks : cache_sizes)
+    {
+        for (int dentries = 1; dentries >= 0; --dentries)
+        {
+            double us;
+            {
+                Quiet quiet;
+                FS fs(disk_backend, cache_blocks, BENCH_DISKNAME);
+                if (fs.format(8192, 4096) != 0)
+                    return -1;
+                if (!dentries)
+                    fs.set_dentry_limit(0);
+                std::string dir;
+                for (int d = 0; d < depth; ++d)
+                {
+                    dir += (d ? "/d" : "d") + std::to_string(d);
+                    fs.mkdir(dir);
+                }
+                for (int f = 0; f < files; ++f)
+                    create_file(fs, dir + "/f" + std::to_string(f), content);
+
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < reads; ++i)
+                    fs.cat(dir + "/f" + std::to_string(i % files));
+                us = elapsed_ms(start) * 1000 / reads;
+            }
+            printf("%11u | %8s | %11.2f\n", cache_blocks, dentries ? "on" : "off", us);
+        }
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// btree creates 16000 files in a hashed and in a B+tree directory, and
+// lists pages of 100 names, the names with a prefix and the whole
+// directory in name order
+static int bench_btree()
+{
+    const unsigned n = 16000, lookups = 2000, pages = 200;
+    const std::string content = make_content(40, 39);
+
+    std::cout << "format | create (us/op) | cat (us/op) | page (us) | prefix (us) | sorted ls (ms)\n";
+    for (int btree = 0; btree <= 1; ++btree)
+    {
+        double times[5];
+        {
+            Quiet quiet;
+            FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(65536, 4096) != 0)
+                return -1;
+            fs.mkdir("d", btree);
+            fs.cd("d");
+            std::mt19937 rng(n);
+            std::vector<std::string> names(n);
+            for (unsigned i = 0; i < n; ++i)
+                names[i] = "file" + std::to_string(rng() % 1000000);
+
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < n; ++i)
+                create_file(fs, names[i], content);
+            times[0] = elapsed_ms(start) * 1000 / n;
+
+            start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < lookups; ++i)
+                fs.cat(names[rng() % n]);
+            times[1] = elapsed_ms(start) * 1000 / lookups;
+
+            // a page of 100 after a random name
+            start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < pages; ++i)
+                fs.ls("", names[rng() % n], 100);
+            times[2] = elapsed_ms(start) * 1000 / pages;
+
+            // about 16 names each
+            start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < pages; ++i)
+                fs.ls("file" + std::to_string(rng() % 1000), "", 0);
+            times[3] = elapsed_ms(start) * 1000 / pages;
+
+            start = std::chrono::steady_clock::now();
+            fs.ls("file", "", 0);
+            times[4] = elapsed_ms(start);
+        }
+        printf("%6s | %14.2f | %11.2f | %9.1f | %11.1f | %14.2f\n", btree ? "btree" : "hashed",
+               times[0], times[1], times[2], times[3], times[4]);
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// inline creates 4000 config-sized files with and without inline data,
+// and reads them back through the default block cache and with none
+static int bench_inline()
+{
+    const unsigned n = 4000, lookups = 4000;
+    const unsigned cache_sizes[] = {CACHE_BLOCKS, 0};
+    const std::string content = make_content(120, 29);
+
+    std::cout << "block cache | inline | blocks used | create (us/op) | cat (us/op)\n";
+    for (unsigned cache_blocks : cache_sizes)
+    {
+        for (int inline_files = 1; inline_files >= 0; --inline_files)
+        {
+            double times[2];
+            unsigned used;
+            {
+                Quiet quiet;
+                FS fs(disk_backend, cache_blocks, BENCH_DISKNAME);
+                if (fs.format(16384, 4096) != 0)
+                    return -1;
+                if (!inline_files)
+                    fs.set_inline_limit(0);
+                unsigned free_blocks = fs.get_free_blocks();
+                std::mt19937 rng(n);
+
+                auto start = std::chrono::steady_clock::now();
+                for (unsigned i = 0; i < n; ++i)
+                    create_file(fs, "conf" + std::to_string(i), content);
+                times[0] = elapsed_ms(start) * 1000 / n;
+                used = free_blocks - fs.get_free_blocks();
+
+                start = std::chrono::steady_clock::now();
+                for (unsigned i = 0; i < lookups; ++i)
+                    fs.cat("conf" + std::to_string(rng() % n));
+                times[1] = elapsed_ms(start) * 1000 / lookups;
+            }
+            printf("%11u | %6s | %11u | %14.2f | %11.2f\n", cache_blocks, inline_files ? "on" : "off",
+                   used, times[0], times[1]);
+        }
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// rmtree removes a tree of 20 directories with 250 files each, with rm -r
+// and one rm per file and directory, until the removal is synced
+static int bench_rmtree()
+{
+    const unsigned dirs = 20, files = 250;
+    const std::string content = make_content(1000, 99);
+
+    std::cout << "method   | files | rm (ms)\n";
+    for (int recursive = 1; recursive >= 0; --recursive)
+    {
+        double ms;
+        {
+            Quiet quiet;
+            FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(16384, 4096) != 0)
+                return -1;
+            fs.mkdir("tree");
+            for (unsigned d = 0; d < dirs; ++d)
+            {
+                std::string dir = "tree/d" + std::to_string(d);
+                fs.mkdir(dir);
+                for (unsigned f = 0; f < files; ++f)
+                    create_file(fs, dir + "/f" + std::to_string(f), content);
+            }
+            fs.sync();
+
+            auto start = std::chrono::steady_clock::now();
+            if (recursive)
+                fs.rm("tree", true);
+            else
+            {
+                for (unsigned d = 0; d < dirs; ++d)
+                {
+                    std::string dir = "tree/d" + std::to_string(d);
+                    for (unsigned f = 0; f < files; ++f)
+                        fs.rm(dir + "/f" + std::to_string(f));
+                    fs.rm(dir);
+                }
+                fs.rm("tree");
+            }
+            fs.sync();
+            ms = elapsed_ms(start);
+        }
+        printf("%-8s | %5u | %7.2f\n", recursive ? "rm -r" : "rm each", dirs * files, ms);
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// walk builds a tree 4 levels deep with 6 directories and 8 small files
+// in every directory, then times du and find over it on 1 to 8 threads
+static void build_tree(FS &fs, const std::string &dir, int depth, const std::string &content)
+{
+    for (int f = 0; f < 8; ++f)
+        create_file(fs, dir + "/f" + std::to_string(f), content);
+    if (depth == 0)
+        return;
+    for (int d = 0; d < 6; ++d)
+    {
+        std::string sub = dir + "/d" + std::to_string(d);
+        fs.mkdir(sub);
+        build_tree(fs, sub, depth - 1, content);
+    }
+}
+
+static int bench_walk()
+{
+    const unsigned threads[] = {1, 2, 4, 8};
+    const int runs = 5;
+    const std::string content = make_content(100, 7);
+    double du_ms[4], find_ms[4];
+
+    {
+        Quiet quiet;
+        FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+        if (fs.format(16384, 4096) != 0)
+            return -1;
+        fs.mkdir("tree");
+        build_tree(fs, "tree", 4, content);
+        fs.sync();
+
+        for (int i = 0; i < 4; ++i)
+        {
+            fs.set_walk_threads(threads[i]);
+            du_ms[i] = find_ms[i] = 1e9;
+            for (int r = 0; r < runs; ++r)
+            {
+                auto start = std::chrono::steady_clock::now();
+                fs.du("tree");
+                du_ms[i] = std::min(du_ms[i], elapsed_ms(start));
+                start = std::chrono::steady_clock::now();
+                fs.find("tree", "f7");
+                find_ms[i] = std::min(find_ms[i], elapsed_ms(start));
+            }
+        }
+    }
+
+    // 1555 directories, 8 files in each. More threads than CPUs only add
+    // switches, the speedup needs as many CPUs
+    std::cout << std::thread::hardware_concurrency() << " CPUs\n";
+    std::cout << "threads | du (ms) | find (ms) | speedup\n";
+    for (int i = 0; i < 4; ++i)
+        printf("%7u | %7.2f | %9.2f | %6.2fx\n", threads[i], du_ms[i], find_ms[i], du_ms[0] / du_ms[i]);
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// handle reads a 16 MiB file 4 KiB at a time through one handle and with
+// an open, seek and close around every read, then writes 2000 records of
+// 100 bytes at its end through one handle and with one append each
+static int bench_handle()
+{
+    const unsigned piece = 4096, records = 2000, record_size = 100;
+    const std::string content = make_content(16 << 20, 999);
+    const std::string record = make_content(record_size, record_size - 1);
+    double read_ms[2], write_ms[2];
+
+    for (int reopen = 0; reopen < 2; ++reopen)
+    {
+        Quiet quiet;
+        FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+        if (fs.format(16384, 4096) != 0)
+            return -1;
+        fs.mkdir("d");
+        create_file(fs, "d/big", content);
+        create_file(fs, "d/log", "");
+        create_file(fs, "d/record", record);
+        std::vector<uint8_t> buf(piece);
+
+        auto start = std::chrono::steady_clock::now();
+        int fd = fs.open("d/big", READ);
+        for (size_t offset = 0; offset < content.size(); offset += piece)
+        {
+            if (reopen)
+            {
+                fd = fs.open("d/big", READ);
+                fs.seek(fd, offset, SEEK_SET);
+            }
+            fs.read(fd, buf.data(), piece);
+            if (reopen)
+                fs.close(fd);
+        }
+        if (!reopen)
+            fs.close(fd);
+        read_ms[reopen] = elapsed_ms(start);
+
+        start = std::chrono::steady_clock::now();
+        fd = fs.open("d/log", WRITE);
+        for (unsigned r = 0; r < records; ++r)
+        {
+            if (reopen)
+                fs.append("d/record", "d/log");
+            else
+                fs.write(fd, (const uint8_t *)record.data(), record.size());
+        }
+        fs.close(fd);
+        fs.sync();
+        write_ms[reopen] = elapsed_ms(start);
+    }
+
+    std::cout << "method       | 4 KiB reads of 16 MiB (ms) | 100 B appends x 2000 (ms)\n";
+    printf("one handle   | %26.2f | %25.2f\n", read_ms[0], write_ms[0]);
+    printf("open per op  | %26.2f | %25.2f\n", read_ms[1], write_ms[1]);
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// transfer copies host files of 1 to 64 MiB in and out, with import and
+// export against a copy through memory, host read() into file handle
+// write() and back
+static int bench_transfer()
+{
+    const size_t sizes[] = {1 << 20, 16 << 20, 64 << 20};
+    const char *host_in = "bench_in.bin", *host_out = "bench_out.bin";
+    const size_t piece = 1 << 20;
+
+    std::cout << "size (MiB) | import (MB/s) | through memory (MB/s) | export (MB/s) | through memory (MB/s)\n";
+    for (size_t size : sizes)
+    {
+        const std::string content = make_content(size, 999);
+        FILE *f = fopen(host_in, "wb");
+        if (f == nullptr || fwrite(content.data(), 1, content.size(), f) != content.size())
+            return -1;
+        fclose(f);
+        std::vector<uint8_t> buf(piece);
+        double import_ms, import_mem_ms, export_ms, export_mem_ms;
+        {
+            Quiet quiet;
+            FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(65536, 4096) != 0)
+                return -1;
+
+            auto start = std::chrono::steady_clock::now();
+            if (fs.import_file(host_in, "a") != 0)
+                return -1;
+            fs.sync();
+            import_ms = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            f = fopen(host_in, "rb");
+            create_file(fs, "b", "");
+            int fd = fs.open("b", WRITE);
+            size_t n;
+            while ((n = fread(buf.data(), 1, piece, f)) > 0)
+                fs.write(fd, buf.data(), n);
+            fs.close(fd);
+            fclose(f);
+            fs.sync();
+            import_mem_ms = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            if (fs.export_file("a", host_out) != 0)
+                return -1;
+            export_ms = elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            f = fopen(host_out, "wb");
+            fd = fs.open("b", READ);
+            int64_t got;
+            while ((got = fs.read(fd, buf.data(), piece)) > 0)
+                fwrite(buf.data(), 1, got, f);
+            fs.close(fd);
+            fclose(f);
+            export_mem_ms = elapsed_ms(start);
+        }
+        printf("%10zu | %13.1f | %21.1f | %13.1f | %21.1f\n", size >> 20, size / 1e3 / import_ms,
+               size / 1e3 / import_mem_ms, size / 1e3 / export_ms, size / 1e3 / export_mem_ms);
+    }
+    remove(host_in);
+    remove(host_out);
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// bulk imports a host tree of 4000 files of 200 B or 3000 B in 40
+// directories with import -r, and with one import or create per file
+static int bench_bulk()
+{
+    const unsigned dirs = 40, files = 100;
+    const char *host_root = "bench_tree";
+    const std::string small = make_content(200, 99), large = make_content(3000, 99);
+
+    ::mkdir(host_root, 0755);
+    for (unsigned d = 0; d < dirs; ++d)
+    {
+        std::string dir = std::string(host_root) + "/d" + std::to_string(d);
+        ::mkdir(dir.c_str(), 0755);
+        for (unsigned f = 0; f < files; ++f)
+        {
+            const std::string &content = f % 2 ? large : small;
+            FILE *file = fopen((dir + "/f" + std::to_string(f)).c_str(), "wb");
+            if (file == nullptr)
+                return -1;
+            fwrite(content.data(), 1, content.size(), file);
+            fclose(file);
+        }
+    }
+
+    const char *methods[] = {"import -r", "import each", "create each"};
+    std::cout << "method      | files | ms      | files/s\n";
+    for (int method = 0; method < 3; ++method)
+    {
+        double ms;
+        {
+            Quiet quiet;
+            FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(16384, 4096) != 0)
+                return -1;
+            auto start = std::chrono::steady_clock::now();
+            if (method == 0)
+                fs.import_file(host_root, "tree", true);
+            else
+            {
+                fs.mkdir("tree");
+                for (unsigned d = 0; d < dirs; ++d)
+                {
+                    std::string dir = "/d" + std::to_string(d);
+                    fs.mkdir("tree" + dir);
+                    for (unsigned f = 0; f < files; ++f)
+                    {
+                        std::string file = dir + "/f" + std::to_string(f);
+                        if (method == 1)
+                            fs.import_file(host_root + file, "tree" + file);
+                        else
+                            create_file(fs, "tree" + file, f % 2 ? large : small);
+                    }
+                }
+                fs.sync();
+            }
+            ms = elapsed_ms(start);
+        }
+        printf("%-11s | %5u | %7.2f | %7.0f\n", methods[method], dirs * files, ms, dirs * files * 1e3 / ms);
+    }
+
+    for (unsigned d = 0; d < dirs; ++d)
+    {
+        std::string dir = std::string(host_root) + "/d" + std::to_string(d);
+        for (unsigned f = 0; f < files; ++f)
+            remove((dir + "/f" + std::to_string(f)).c_str());
+        remove(dir.c_str());
+    }
+    remove(host_root);
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// reflink copies 1 to 64 MiB files with cp and cp --reflink, then
+// writes the copy: 4 KiB at the start, 4 KiB in the middle and a 100 B
+// append, each copying the shared blocks up to the one it changes
+static int bench_reflink()
+{
+    const size_t sizes[] = {1 << 20, 16 << 20, 64 << 20};
+    const std::string piece = make_content(4096, 99), record = make_content(100, 99);
+
+    std::cout << "size (MiB) | method       | cp (ms) | blocks | write start (ms) | write middle (ms) | append (ms)\n";
+    for (size_t size : sizes)
+    {
+        const std::string content = make_content(size, 999);
+        for (int reflink = 0; reflink < 2; ++reflink)
+        {
+            double cp_ms, write_ms[3];
+            unsigned used;
+            {
+                Quiet quiet;
+                FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+                if (fs.format(65536, 4096) != 0)
+                    return -1;
+                create_file(fs, "a", content);
+                fs.sync();
+
+                unsigned free_blocks = fs.get_free_blocks();
+                auto start = std::chrono::steady_clock::now();
+                if (fs.cp("a", "b", reflink) != 0)
+                    return -1;
+                fs.sync();
+                cp_ms = elapsed_ms(start);
+                used = free_blocks - fs.get_free_blocks();
+
+                const uint32_t offsets[] = {0, (uint32_t)content.size() / 2};
+                for (int i = 0; i < 3; ++i)
+                {
+                    start = std::chrono::steady_clock::now();
+                    int fd = fs.open("b", WRITE);
+                    if (i < 2)
+                    {
+                        fs.seek(fd, offsets[i], SEEK_SET);
+                        fs.write(fd, (const uint8_t *)piece.data(), piece.size());
+                    }
+                    else
+                    {
+                        fs.seek(fd, 0, SEEK_END);
+                        fs.write(fd, (const uint8_t *)record.data(), record.size());
+                    }
+                    fs.close(fd);
+                    fs.sync();
+                    write_ms[i] = elapsed_ms(start);
+                }
+            }
+            printf("%10zu | %-12s | %7.2f | %6u | %16.2f | %17.2f | %11.2f\n", size >> 20,
+                   reflink ? "cp --reflink" : "cp", cp_ms, used, write_ms[0], write_ms[1], write_ms[2]);
+        }
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// drops the disk file from the page cache, so the next reads go to the disk
+static void drop_disk_cache()
+{
+    int fd = ::open(BENCH_DISKNAME, O_RDONLY);
+    if (fd < 0)
+        return; // the RAM disk has no file
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+// stream copies a file of 1 MiB to 1 GiB with cp and appends it to a small
+// file, with and without read-ahead, the disk file dropped from the page
+// cache before each. Memory is the largest buffer allocated meanwhile.
+static int bench_stream()
+{
+    const size_t sizes[] = {1 << 20, 16 << 20, 256 << 20, 1 << 30};
+    const size_t piece = 1 << 20;
+    const std::string content = make_content(piece, 999);
+
+    std::cout << "size (MiB) | read-ahead | cp (MB/s) | append (MB/s) | largest buffer (KiB)\n";
+    for (size_t size : sizes)
+    {
+        for (unsigned ahead : {0u, (unsigned)STREAM_AHEAD})
+        {
+            double cp_ms, append_ms;
+            size_t largest;
+            {
+                Quiet quiet;
+                FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+                // the source and one copy of it at a time
+                if (fs.format(2 * size / 4096 + 4096, 4096) != 0)
+                    return -1;
+                fs.set_stream_ahead(ahead);
+                create_file(fs, "log", "x");
+                create_file(fs, "a", "");
+                int fd = fs.open("a", WRITE);
+                for (size_t done = 0; done < size; done += piece)
+                    fs.write(fd, (const uint8_t *)content.data(), piece);
+                fs.close(fd);
+                fs.sync();
+
+                drop_disk_cache();
+                largest_allocation = 0;
+                auto start = std::chrono::steady_clock::now();
+                if (fs.cp("a", "b") != 0)
+                    return -1;
+                fs.sync();
+                cp_ms = elapsed_ms(start);
+                largest = largest_allocation;
+                fs.rm("b");
+                fs.sync();
+
+                drop_disk_cache();
+                largest_allocation = 0;
+                start = std::chrono::steady_clock::now();
+                if (fs.append("a", "log") != 0)
+                    return -1;
+                fs.sync();
+                append_ms = elapsed_ms(start);
+                largest = std::max(largest, largest_allocation);
+            }
+            printf("%10zu | %10u | %9.1f | %13.1f | %20zu\n", size >> 20, ahead, size / 1e3 / cp_ms,
+                   size / 1e3 / append_ms, largest >> 10);
+        }
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// tail appends a 100 B record to a log of 1 MiB to 256 MiB, with the last
+// block of the log remembered and walking its chain on every append
+static int bench_tail()
+{
+    const size_t sizes[] = {1 << 20, 4 << 20, 16 << 20, 64 << 20, 256 << 20};
+    const size_t piece = 1 << 20;
+    const int appends = 200;
+    const std::string content = make_content(piece, 999), record = make_content(100, 99);
+
+    std::cout << "log (MiB) | walk (us/append) | tail hint (us/append)\n";
+    double us[2][sizeof(sizes) / sizeof(sizes[0])];
+    for (int hints = 0; hints < 2; ++hints)
+    {
+        Quiet quiet;
+        FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+        if (fs.format(80000, 4096) != 0)
+            return -1;
+        fs.set_tail_hints(hints);
+        create_file(fs, "record", record);
+        create_file(fs, "log", "");
+        size_t size = 0;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        {
+            // grow the log through a handle, then time the appends
+            int fd = fs.open("log", WRITE);
+            fs.seek(fd, 0, SEEK_END);
+            for (; size < sizes[i]; size += piece)
+                fs.write(fd, (const uint8_t *)content.data(), piece);
+            fs.close(fd);
+            fs.sync();
+
+            auto start = std::chrono::steady_clock::now();
+            for (int n = 0; n < appends; ++n)
+            {
+                if (fs.append("record", "log") != 0)
+                    return -1;
+            }
+            us[hints][i] = elapsed_ms(start) * 1000 / appends;
+        }
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        printf("%9zu | %16.1f | %21.1f\n", sizes[i] >> 20, us[0][i], us[1][i]);
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// pwd builds the path of a directory 4 to 64 levels deep, with 32 other
+// directories next to each level, the first time after mount and after that
+static int bench_pwd()
+{
+    const int depths[] = {4, 16, 64};
+    const int siblings = 32, reads = 20000;
+
+    std::cout << "depth | first pwd (us) | pwd (us/op)\n";
+    for (int depth : depths)
+    {
+        double first_us, us;
+        {
+            Quiet quiet;
+            FS fs(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+            if (fs.format(8192, 4096) != 0)
+                return -1;
+            for (int d = 0; d < depth; ++d)
+            {
+                for (int s = 0; s < siblings; ++s)
+                    fs.mkdir("s" + std::to_string(s));
+                fs.mkdir("d" + std::to_string(d));
+                fs.cd("d" + std::to_string(d));
+            }
+
+            fs.mount();
+            auto start = std::chrono::steady_clock::now();
+            fs.pwd();
+            first_us = elapsed_ms(start) * 1000;
+
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < reads; ++i)
+                fs.pwd();
+            us = elapsed_ms(start) * 1000 / reads;
+        }
+        printf("%5d | %14.2f | %11.2f\n", depth, first_us, us);
+    }
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// directory blocks for the dirscan benchmark, names of 4 to 40 characters
+// in every slot, or in one slot out of eight
+static std::vector<std::vector<uint8_t>> make_dir_blocks(unsigned count, unsigned block_size, bool sparse,
+                                                         std::vector<std::string> &names, std::mt19937 &rng)
+{
+    std::vector<std::vector<uint8_t>> blocks(count, std::vector<uint8_t>(block_size, 0));
+    for (auto &block : blocks)
+    {
+        struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(block.data());
+        for (unsigned i = 0; i < block_size / sizeof(struct dir_entry); ++i)
+        {
+            if (sparse && rng() % 8 != 0)
+                continue;
+            std::string name = "f" + std::to_string(rng());
+            name.resize(4 + rng() % 37, 'n');
+            strcpy(entries[i].file_name, name.c_str());
+            names.push_back(name);
+        }
+    }
+    return blocks;
+}
+
+// the entry loops every directory walk used before the scan kernels
+static int old_find(const std::string &name, struct dir_entry *entries, unsigned count)
+{
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (strcmp(entries[i].file_name, name.c_str()) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int old_find_free(struct dir_entry *entries, unsigned count)
+{
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (entries[i].file_name[0] == '\0')
+            return i;
+    }
+    return -1;
+}
+
+static unsigned old_list(struct dir_entry *entries, unsigned count)
+{
+    unsigned used = 0;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (entries[i].file_name[0] != '\0')
+            used++;
+    }
+    return used;
+}
+
+static unsigned scan_list(const uint8_t *data, unsigned count)
+{
+    unsigned used = 0;
+    for (unsigned base = 0; base < count; base += DIRSCAN_BATCH)
+        used += __builtin_popcountll(dirscan_used(data + base * DIRSCAN_ENTRY_SIZE, std::min(count - base, (unsigned)DIRSCAN_BATCH)));
+    return used;
+}
+
+// dirscan compares the old per-entry loops with the scan kernels on full
+// and sparse directory blocks: finding a name that is there, one that
+// isn't, a free slot, and walking the used slots as ls does
+static int bench_dirscan()
+{
+    const unsigned block_sizes[] = {4096, 65536};
+    const int kernels[] = {DIRSCAN_SCALAR, DIRSCAN_SSE2, DIRSCAN_AVX2};
+    const int rounds = 200000;
+    const int best = dirscan_get_kernel();
+
+    std::cout << "block | fill   | kernel | hit (ns) | miss (ns) | free slot (ns) | list (ns)\n";
+    for (unsigned block_size : block_sizes)
+    {
+        Quiet quiet;
+        FS fs(DISK_RAM, CACHE_BLOCKS, BENCH_DISKNAME);
+        if (fs.format(1024, block_size) != 0)
+            return -1;
+        for (int sparse = 0; sparse <= 1; ++sparse)
+        {
+            std::mt19937 rng(block_size + sparse);
+            std::vector<std::string> names;
+            const unsigned nblocks = 16, count = block_size / sizeof(struct dir_entry);
+            auto blocks = make_dir_blocks(nblocks, block_size, sparse, names, rng);
+            std::vector<std::string> hits, misses;
+            for (int i = 0; i < 1024; ++i)
+            {
+                hits.push_back(names[rng() % names.size()]);
+                misses.push_back("m" + std::to_string(rng()));
+            }
+
+            // every kernel has to agree with the old loops
+            for (int kernel : kernels)
+            {
+                if (!dirscan_set_kernel(kernel))
+                    continue;
+                for (auto &block : blocks)
+                {
+                    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(block.data());
+                    for (int i = 0; i < 64; ++i)
+                    {
+                        const std::string &name = hits[i];
+                        if (fs.find_directory_entry(name, entries) != old_find(name, entries, count) ||
+                            fs.find_directory_entry(misses[i], entries) != -1 ||
+                            fs.find_free_directory_entry(entries) != old_find_free(entries, count) ||
+                            scan_list(block.data(), count) != old_list(entries, count))
+                        {
+                            quiet.~Quiet();
+                            std::cerr << "dirscan: " << dirscan_kernel_name(kernel) << " disagrees with the scalar loops\n";
+                            exit(1);
+                        }
+                    }
+                }
+            }
+
+            for (int kernel = -1; kernel <= DIRSCAN_AVX2; ++kernel)
+            {
+                if (kernel >= 0 && !dirscan_set_kernel(kernel))
+                    continue;
+                double ns[4];
+                volatile long sink = 0;
+                for (int op = 0; op < 4; ++op)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    for (int r = 0; r < rounds; ++r)
+                    {
+                        struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(blocks[r % nblocks].data());
+                        const std::string &hit = hits[r % hits.size()], &miss = misses[r % misses.size()];
+                        if (op == 0)
+                            sink += kernel < 0 ? old_find(hit, entries, count) : fs.find_directory_entry(hit, entries);
+                        else if (op == 1)
+                            sink += kernel < 0 ? old_find(miss, entries, count) : fs.find_directory_entry(miss, entries);
+                        else if (op == 2)
+                            sink += kernel < 0 ? old_find_free(entries, count) : fs.find_free_directory_entry(entries);
+                        else
+                            sink += kernel < 0 ? old_list(entries, count) : scan_list(blocks[r % nblocks].data(), count);
+                    }
+                    ns[op] = elapsed_ms(start) * 1e6 / rounds;
+                }
+                printf("%5u | %-6s | %-6s | %8.1f | %9.1f | %14.1f | %9.1f\n", block_size, sparse ? "sparse" : "full",
+                       kernel < 0 ? "loop" : dirscan_kernel_name(kernel), ns[0], ns[1], ns[2], ns[3]);
+            }
+        }
+    }
+    dirscan_set_kernel(best);
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+// the path splitting every command did before PathIterator
+static std::vector<std::string> split_path(std::string path)
+{
+    std::vector<std::string> parts;
+    std::stringstream path_stream(path);
+    std::string part;
+    while (std::getline(path_stream, part, '/'))
+    {
+        if (part == "" || part == ".")
+            continue;
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+// paths counts the heap allocations of splitting a path into components
+// with a stringstream and with PathIterator, and of each command on a
+// path four directories deep. The file data a command moves is allocated
+// too, the files are kept small.
+static int bench_paths()
+{
+    const int runs = 10000;
+    const std::string path = "dir0/dir1/dir2/dir3/file_with_a_long_name";
+
+    std::cout << "split        | allocs/path | ns/path\n";
+    uint64_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    size_t n = 0;
+    for (int i = 0; i < runs; ++i)
+        n += split_path(path).size();
+    printf("stringstream | %11.1f | %7.1f\n", (double)(allocations - before) / runs,
+           elapsed_ms(start) * 1e6 / runs);
+    before = allocations;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+    {
+        PathIterator it(path);
+        std::string_view part;
+        while (it.next(part))
+            n += part.size();
+    }
+    printf("PathIterator | %11.1f | %7.1f\n", (double)(allocations - before) / runs,
+           elapsed_ms(start) * 1e6 / runs);
+    if (n == 0)
+        return -1;
+
+    const int calls = 1000;
+    const std::string dir = "dir0/dir1/dir2/dir3/";
+    const std::string file = dir + "file_with_a_long_name";
+    const std::string other = dir + "another_file_with_a_long_name";
+    const std::string root = "/", small = dir + "small", grows = dir + "grows";
+    const std::string content = make_content(40, 39);
+    struct command
+    {
+        const char *name;
+        std::function<void(FS &, int)> run;
+    };
+    const command commands[] = {
+        {"cd", [&](FS &fs, int i) { fs.cd(i % 2 ? root : dir); }},
+        {"cat", [&](FS &fs, int) { fs.cat(file); }},
+        {"chmod", [&](FS &fs, int i) { fs.chmod(i % 2 ? "6" : "4", file); }},
+        {"mv", [&](FS &fs, int i) { fs.mv(i % 2 ? other : file, i % 2 ? file : other); }},
+        {"cp/rm", [&](FS &fs, int i) {
+             if (i % 2)
+                 fs.rm(other);
+             else
+                 fs.cp(file, other);
+         }},
+        {"mkdir/rm", [&](FS &fs, int i) {
+             if (i % 2)
+                 fs.rm(other);
+             else
+                 fs.mkdir(other);
+         }},
+        {"append", [&](FS &fs, int) { fs.append(small, grows); }},
+    };
+
+    std::cout << "command  | allocs/call | us/call\n";
+    FS *fs;
+    {
+        Quiet quiet;
+        fs = new FS(disk_backend, CACHE_BLOCKS, BENCH_DISKNAME);
+        if (fs->format(65536, 4096) != 0)
+            return -1;
+        for (int d = 0; d < 4; ++d)
+            fs->mkdir(dir.substr(0, 5 * d + 4));
+        create_file(*fs, file, content);
+        create_file(*fs, small, "x");
+        create_file(*fs, grows, "x");
+    }
+    for (const command &c : commands)
+    {
+        double us, allocs;
+        {
+            Quiet quiet;
+            c.run(*fs, 0); // warm up the caches
+            c.run(*fs, 1);
+            uint64_t before = allocations;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < calls; ++i)
+                c.run(*fs, i);
+            us = elapsed_ms(start) * 1000 / calls;
+            allocs = (double)(allocations - before) / calls;
+        }
+        printf("%-8s | %11.1f | %7.2f\n", c.name, allocs, us);
+    }
+    delete fs;
+    remove(BENCH_DISKNAME);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    std::string benchmark = argc > 1 ? argv[1] : "";
+    for (int i = 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--mmap") == 0)
+            disk_backend = DISK_MMAP;
+        else if (strcmp(argv[i], "--uring") == 0)
+            disk_backend = DISK_URING;
+        else if (strcmp(argv[i], "--ram") == 0)
+            disk_backend = DISK_RAM;
+    }
+
+    if (benchmark == "geometry")
+        return bench_geometry() == 0 ? 0 : 1;
+    if (benchmark == "alloc")
+        return bench_alloc() == 0 ? 0 : 1;
+    if (benchmark == "vector")
+        return bench_vector() == 0 ? 0 : 1;
+    if (benchmark == "backends")
+        return bench_backends() == 0 ? 0 : 1;
+    if (benchmark == "dir")
+        return bench_dir() == 0 ? 0 : 1;
+    if (benchmark == "dentry")
+        return bench_dentry() == 0 ? 0 : 1;
+    if (benchmark == "paths")
+        return bench_paths() == 0 ? 0 : 1;
+    if (benchmark == "dirscan")
+        return bench_dirscan() == 0 ? 0 : 1;
+    if (benchmark == "pwd")
+        return bench_pwd() == 0 ? 0 : 1;
+    if (benchmark == "btree")
+        return bench_btree() == 0 ? 0 : 1;
+    if (benchmark == "inline")
+        return bench_inline() == 0 ? 0 : 1;
+    if (benchmark == "rmtree")
+        return bench_rmtree() == 0 ? 0 : 1;
+    if (benchmark == "walk")
+        return bench_walk() == 0 ? 0 : 1;
+    if (benchmark == "handle")
+        return bench_handle() == 0 ? 0 : 1;
+    if (benchmark == "transfer")
+        return bench_transfer() == 0 ? 0 : 1;
+    if (benchmark == "bulk")
+        return bench_bulk() == 0 ? 0 : 1;
+    if (benchmark == "reflink")
+        return bench_reflink() == 0 ? 0 : 1;
+    if (benchmark == "stream")
+        return bench_stream() == 0 ? 0 : 1;
+    if (benchmark == "tail")
+        return bench_tail() == 0 ? 0 : 1;
+
+    std::cerr << "Usage: " << argv[0] << " <benchmark> [--mmap | --uring | --ram]\n";
+    std::cerr << "Benchmarks: geometry, alloc, vector, backends, dir, dentry, paths, dirscan, pwd, btree, inline, rmtree, walk, handle, transfer, bulk, reflink, stream, tail\n";
+    return 1;
+}
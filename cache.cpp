@@ -0,0 +1,233 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include "cache.h"
+
+BlockCache::BlockCache(BlockDevice &disk, unsigned capacity)
+    : disk(disk), capacity(capacity), slots(capacity)
+{
+    reset();
+}
+
+BlockCache::~BlockCache()
+{
+    sync();
+}
+
+// picks a slot to reuse with the CLOCK algorithm, a dirty victim is
+// written back to the disk first
+int BlockCache::evict()
+{
+    while (true)
+    {
+        unsigned slot = hand;
+        hand = (hand + 1) % capacity;
+        cache_slot &s = slots[slot];
+        if (!s.valid)
+            return slot;
+        if (s.referenced)
+        { // second chance
+            s.referenced = false;
+            continue;
+        }
+        if (s.dirty)
+        {
+            if (disk.write(s.block_no, slot_data(slot)) != 0)
+                return -1;
+            writebacks++;
+        }
+        index.erase(s.block_no);
+        s.valid = false;
+        s.dirty = false;
+        evictions++;
+        return slot;
+    }
+}
+
+// returns the slot holding block_no, or -1. On a miss a slot is
+// allocated, and filled from the disk if load is set.
+int BlockCache::lookup(unsigned block_no, bool load)
+{
+    if (capacity == 0)
+        return -1;
+    auto it = index.find(block_no);
+    if (it != index.end())
+    {
+        hits++;
+        slots[it->second].referenced = true;
+        return it->second;
+    }
+    misses++;
+    int slot = evict();
+    if (slot == -1)
+        return -1;
+    if (load && disk.read(block_no, slot_data(slot)) != 0)
+        return -1;
+    cache_slot &s = slots[slot];
+    s.block_no = block_no;
+    s.valid = true;
+    s.dirty = false;
+    s.referenced = true;
+    index[block_no] = slot;
+    return slot;
+}
+
+// reads one block, through the cache
+int BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    reads++;
+    int slot = lookup(block_no, true);
+    if (slot == -1)
+        return disk.read(block_no, blk);
+    memcpy(blk, slot_data(slot), block_size);
+    return 0;
+}
+
+// writes one block into the cache, it reaches the disk on eviction or sync
+int BlockCache::write(unsigned block_no, uint8_t *blk)
+{
+    writes++;
+    int slot = lookup(block_no, false);
+    if (slot == -1)
+        return disk.write(block_no, blk);
+    memcpy(slot_data(slot), blk, block_size);
+    slots[slot].dirty = true;
+    return 0;
+}
+
+// reads block_nos[i] into blks[i]. The misses are read from the disk
+// in one vectored call and kept in the cache unless the request is
+// as large as the cache.
+int BlockCache::readv(const std::vector<unsigned> &block_nos, const std::vector<uint8_t *> &blks)
+{
+    reads += block_nos.size();
+    std::vector<unsigned> miss_blocks;
+    std::vector<uint8_t *> miss_blks;
+    for (size_t i = 0; i < block_nos.size(); ++i)
+    {
+        auto it = index.find(block_nos[i]);
+        if (it == index.end())
+        {
+            miss_blocks.push_back(block_nos[i]);
+            miss_blks.push_back(blks[i]);
+            continue;
+        }
+        hits++;
+        slots[it->second].referenced = true;
+        memcpy(blks[i], slot_data(it->second), block_size);
+    }
+    if (miss_blocks.empty())
+        return 0;
+    if (disk.readv(miss_blocks, miss_blks) != 0)
+        return -1;
+    if (miss_blocks.size() >= capacity)
+    { // a big sequential read would only flush the cache
+        misses += miss_blocks.size();
+        return 0;
+    }
+    for (size_t i = 0; i < miss_blocks.size(); ++i)
+    {
+        int slot = lookup(miss_blocks[i], false);
+        if (slot != -1)
+            memcpy(slot_data(slot), miss_blks[i], block_size);
+    }
+    return 0;
+}
+
+// writes blks[i] to block_nos[i]. Requests as large as the cache go
+// straight to the disk in one vectored call instead of flushing it.
+int BlockCache::writev(const std::vector<unsigned> &block_nos, const std::vector<uint8_t *> &blks)
+{
+    if (block_nos.size() < capacity)
+    { // counted by write()
+        for (size_t i = 0; i < block_nos.size(); ++i)
+        {
+            if (write(block_nos[i], blks[i]) != 0)
+                return -1;
+        }
+        return 0;
+    }
+    writes += block_nos.size();
+    if (disk.writev(block_nos, blks) != 0)
+        return -1;
+    // cached copies are now older than the disk
+    for (unsigned block_no : block_nos)
+    {
+        auto it = index.find(block_no);
+        if (it == index.end())
+            continue;
+        slots[it->second].valid = false;
+        slots[it->second].dirty = false;
+        index.erase(it);
+    }
+    return 0;
+}
+
+// returns a pointer to the cached block, valid until the next cache call.
+// Returns nullptr if the block can't be cached.
+const uint8_t *BlockCache::get(unsigned block_no)
+{
+    reads++;
+    int slot = lookup(block_no, true);
+    if (slot == -1)
+        return nullptr;
+    return slot_data(slot);
+}
+
+// writes all dirty blocks to the disk, in block order so adjacent
+// blocks go out in one vectored call
+int BlockCache::sync()
+{
+    std::vector<unsigned> dirty;
+    for (unsigned i = 0; i < capacity; ++i)
+    {
+        if (slots[i].valid && slots[i].dirty)
+            dirty.push_back(i);
+    }
+    if (dirty.empty())
+        return 0;
+    std::sort(dirty.begin(), dirty.end(), [this](unsigned a, unsigned b)
+              { return slots[a].block_no < slots[b].block_no; });
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t *> blks;
+    for (unsigned slot : dirty)
+    {
+        block_nos.push_back(slots[slot].block_no);
+        blks.push_back(slot_data(slot));
+    }
+    if (disk.writev(block_nos, blks) != 0)
+        return -1;
+    for (unsigned slot : dirty)
+        slots[slot].dirty = false;
+    writebacks += dirty.size();
+    return 0;
+}
+
+// drops a block without writing it back, its content no longer matters
+void BlockCache::discard(unsigned block_no)
+{
+    auto it = index.find(block_no);
+    if (it == index.end())
+        return;
+    cache_slot &s = slots[it->second];
+    s.valid = false;
+    s.dirty = false;
+    s.referenced = false;
+    index.erase(it);
+}
+
+// drops every cached block without writing it back and picks up the
+// block size of the disk again, used when the disk is reformatted
+void BlockCache::reset()
+{
+    block_size = disk.get_block_size();
+    buffers.assign((size_t)capacity * block_size, 0);
+    for (auto &slot : slots)
+    {
+        slot.valid = false;
+        slot.dirty = false;
+        slot.referenced = false;
+    }
+    index.clear();
+    hand = 0;
+}
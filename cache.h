@@ -0,0 +1,76 @@
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "device.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#define CACHE_BLOCKS 64 // default capacity in blocks
+
+// Write-back block cache between the file system and the block device.
+// Blocks are evicted with the CLOCK algorithm, dirty blocks are written
+// to the disk when they are evicted or when sync() is called.
+// A capacity of 0 turns the cache into a write-through pass-through.
+class BlockCache {
+private:
+    struct cache_slot {
+        unsigned block_no;
+        bool valid;
+        bool dirty;
+        bool referenced; // CLOCK reference bit
+    };
+    BlockDevice &disk;
+    unsigned capacity;
+    unsigned block_size;
+    std::vector<cache_slot> slots;
+    std::vector<uint8_t> buffers; // capacity * block_size bytes
+    std::unordered_map<unsigned, unsigned> index; // block_no -> slot
+    unsigned hand = 0;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t writebacks = 0;
+    uint64_t reads = 0;  // blocks read through the cache
+    uint64_t writes = 0; // blocks written through the cache
+
+    uint8_t *slot_data(unsigned slot) { return &buffers[(size_t)slot * block_size]; }
+    int lookup(unsigned block_no, bool load);
+    int evict();
+public:
+    BlockCache(BlockDevice &disk, unsigned capacity = CACHE_BLOCKS);
+    ~BlockCache();
+    // reads one block, through the cache
+    int read(unsigned block_no, uint8_t *blk);
+    // writes one block into the cache, it reaches the disk on eviction or sync
+    int write(unsigned block_no, uint8_t *blk);
+    // reads block_nos[i] into blks[i]. The misses are read from the disk
+    // in one vectored call and kept in the cache unless the request is
+    // as large as the cache.
+    int readv(const std::vector<unsigned> &block_nos, const std::vector<uint8_t *> &blks);
+    // writes blks[i] to block_nos[i]. Requests as large as the cache go
+    // straight to the disk in one vectored call instead of flushing it.
+    int writev(const std::vector<unsigned> &block_nos, const std::vector<uint8_t *> &blks);
+    // returns a pointer to the cached block, valid until the next cache call.
+    // Returns nullptr if the block can't be cached.
+    const uint8_t *get(unsigned block_no);
+    // writes all dirty blocks to the disk, in block order
+    int sync();
+    // drops a block without writing it back, for a block that was freed
+    void discard(unsigned block_no);
+    // drops every cached block without writing it back and picks up the
+    // block size of the disk again, used when the disk is reformatted
+    void reset();
+
+    unsigned get_capacity() { return capacity; }
+    uint64_t get_hits() { return hits; }
+    uint64_t get_misses() { return misses; }
+    uint64_t get_evictions() { return evictions; }
+    uint64_t get_writebacks() { return writebacks; }
+    uint64_t get_reads() { return reads; }
+    uint64_t get_writes() { return writes; }
+    void reset_stats() { hits = misses = evictions = writebacks = reads = writes = 0; }
+};
+
+#endif // __CACHE_H__
@@ -0,0 +1,12 @@
+#include "device.h"
+#include "disk.h"
+#include "ramdisk.h"
+
+// creates the device for a backend, name is the disk file if it has one
+BlockDevice *
+open_block_device(int backend, const std::string& name)
+{
+    if (backend == DISK_RAM)
+        return new RamDisk();
+    return new Disk(backend, name);
+}
@@ -0,0 +1,92 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_NO_BLOCKS 2048
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+// device backends, selected when the file system is constructed
+#define DISK_FSTREAM 0
+#define DISK_MMAP 1
+#define DISK_URING 2 // io_uring, preadv/pwritev if the kernel lacks it
+#define DISK_RAM 3   // in memory, nothing survives the process
+
+// A block device the file system and the cache run on. Disk keeps the
+// blocks in a file, RamDisk in memory.
+class BlockDevice {
+protected:
+    unsigned no_blocks = DEFAULT_NO_BLOCKS;
+    unsigned block_size = DEFAULT_BLOCK_SIZE;
+    uint64_t io_calls = 0;  // read/write system calls issued
+    uint64_t io_blocks = 0; // blocks moved by them
+    uint64_t block_reads = 0;
+    uint64_t block_writes = 0;
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    uint64_t flushes = 0; // sync calls
+    bool formatted = true; // false for content of an older layout
+    void count_reads(uint64_t blocks) { block_reads += blocks; bytes_read += blocks * block_size; }
+    void count_writes(uint64_t blocks) { block_writes += blocks; bytes_written += blocks * block_size; }
+public:
+    virtual ~BlockDevice() {}
+    unsigned get_no_blocks() { return no_blocks; }
+    unsigned get_block_size() { return block_size; }
+    uint64_t get_disk_size() { return (uint64_t)block_size * no_blocks; }
+    // false if the content is of an older on-disk layout and must be
+    // formatted before it can be used
+    bool is_formatted() { return formatted; }
+    // recreates the device with a new geometry, the content is lost
+    virtual int resize(unsigned no_blocks, unsigned block_size) = 0;
+    // writes one block to the device
+    virtual int write(unsigned block_no, uint8_t *blk) = 0;
+    // reads one block from the device
+    virtual int read(unsigned block_no, uint8_t *blk) = 0;
+    // reads one block like read, but is safe to call from several threads
+    // at once, e.g. the workers of a tree walk. It counts nothing, the
+    // counters aren't shared between threads.
+    virtual int read_concurrent(unsigned block_no, uint8_t *blk) = 0;
+    // reads block_nos[i] into blks[i]
+    virtual int readv(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks) = 0;
+    // writes blks[i] to block_nos[i]
+    virtual int writev(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks) = 0;
+    // returns a pointer to the block in place, or nullptr if the device
+    // can't hand out block pointers (zero-copy access)
+    virtual uint8_t *block_ptr(unsigned /*block_no*/) { return nullptr; }
+    // copy length bytes from offset of the file fd to the device, from the
+    // start of block_no on, and back, without passing them through user
+    // space. Return the bytes copied, -1 if the device can't, then the
+    // caller goes through memory. The cache is bypassed.
+    virtual int64_t copy_in(int /*fd*/, uint64_t /*offset*/, unsigned /*block_no*/, uint64_t /*length*/) { return -1; }
+    virtual int64_t copy_out(unsigned /*block_no*/, uint64_t /*length*/, int /*fd*/, uint64_t /*offset*/) { return -1; }
+    // starts reading block_nos in the background, so a read of them later
+    // doesn't wait for the disk. Only a hint, in-memory devices ignore it.
+    virtual void prefetch(const std::vector<unsigned>& /*block_nos*/) {}
+    // makes all writes durable
+    virtual int sync() { return 0; }
+
+    // system calls issued and blocks moved, blocks - calls were saved
+    // by coalescing adjacent blocks. Always 0 for in-memory devices.
+    uint64_t get_io_calls() { return io_calls; }
+    uint64_t get_io_blocks() { return io_blocks; }
+    // blocks and bytes moved and sync calls, whatever the backend
+    uint64_t get_block_reads() { return block_reads; }
+    uint64_t get_block_writes() { return block_writes; }
+    uint64_t get_bytes_read() { return bytes_read; }
+    uint64_t get_bytes_written() { return bytes_written; }
+    uint64_t get_flushes() { return flushes; }
+    void reset_io_stats()
+    {
+        io_calls = io_blocks = 0;
+        block_reads = block_writes = bytes_read = bytes_written = flushes = 0;
+    }
+};
+
+// creates the device for a backend, name is the disk file if it has one
+BlockDevice *open_block_device(int backend, const std::string& name);
+
+#endif // __DEVICE_H__
@@ -0,0 +1,204 @@
+#include <cstring>
+#include "dirscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSCAN_X86
+#endif
+
+void dirscan_make_key(std::string_view name, struct dirscan_key &key)
+{
+    memset(key.bytes, 0, sizeof(key.bytes));
+    key.length = name.size() < DIRSCAN_PREFIX ? name.size() + 1 : DIRSCAN_PREFIX;
+    memcpy(key.bytes, name.data(), key.length > name.size() ? name.size() : key.length);
+}
+
+// the first byte of every entry, one entry per iteration
+static uint64_t used_scalar(const uint8_t *entries, unsigned count)
+{
+    uint64_t used = 0;
+    for (unsigned i = 0; i < count; ++i)
+        used |= (uint64_t)(entries[i * DIRSCAN_ENTRY_SIZE] != 0) << i;
+    return used;
+}
+
+static uint64_t match_scalar(const uint8_t *entries, unsigned count, const struct dirscan_key &key)
+{
+    uint64_t match = 0;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (memcmp(entries + i * DIRSCAN_ENTRY_SIZE, key.bytes, key.length) == 0)
+            match |= 1ULL << i;
+    }
+    return match;
+}
+
+#ifdef DIRSCAN_X86
+
+// loads the first four bytes of an entry into the low lane
+__attribute__((target("sse2"))) static inline __m128i first_word(const uint8_t *entry)
+{
+    int word;
+    memcpy(&word, entry, sizeof(word));
+    return _mm_cvtsi32_si128(word);
+}
+
+// four first bytes per compare
+__attribute__((target("sse2"))) static uint64_t used_sse2(const uint8_t *entries, unsigned count)
+{
+    const __m128i low_byte = _mm_set1_epi32(0xff);
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t used = 0;
+    unsigned i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const uint8_t *e = entries + i * DIRSCAN_ENTRY_SIZE;
+        // built in registers, _mm_set_epi32 goes through the stack
+        __m128i first = _mm_unpacklo_epi64(
+            _mm_unpacklo_epi32(first_word(e), first_word(e + DIRSCAN_ENTRY_SIZE)),
+            _mm_unpacklo_epi32(first_word(e + 2 * DIRSCAN_ENTRY_SIZE), first_word(e + 3 * DIRSCAN_ENTRY_SIZE)));
+        __m128i empty = _mm_cmpeq_epi32(_mm_and_si128(first, low_byte), zero);
+        uint64_t bits = ~_mm_movemask_ps(_mm_castsi128_ps(empty)) & 0xf;
+        used |= bits << i;
+    }
+    return used | (used_scalar(entries + i * DIRSCAN_ENTRY_SIZE, count - i) << i);
+}
+
+// one 16 byte name prefix per compare
+__attribute__((target("sse2"))) static uint64_t match_sse2(const uint8_t *entries, unsigned count, const struct dirscan_key &key)
+{
+    const __m128i k = _mm_loadu_si128((const __m128i *)key.bytes);
+    const unsigned mask = (1u << key.length) - 1;
+    uint64_t match = 0;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        __m128i name = _mm_loadu_si128((const __m128i *)(entries + i * DIRSCAN_ENTRY_SIZE));
+        unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(name, k));
+        if ((eq & mask) == mask)
+            match |= 1ULL << i;
+    }
+    return match;
+}
+
+// eight first bytes per gather
+__attribute__((target("avx2"))) static uint64_t used_avx2(const uint8_t *entries, unsigned count)
+{
+    const __m256i offsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i offsets_bytes = _mm256_mullo_epi32(offsets, _mm256_set1_epi32(DIRSCAN_ENTRY_SIZE));
+    const __m256i low_byte = _mm256_set1_epi32(0xff);
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t used = 0;
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i first = _mm256_i32gather_epi32((const int *)(entries + i * DIRSCAN_ENTRY_SIZE), offsets_bytes, 1);
+        __m256i empty = _mm256_cmpeq_epi32(_mm256_and_si256(first, low_byte), zero);
+        uint64_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(empty)) & 0xff;
+        used |= bits << i;
+    }
+    return used | (used_scalar(entries + i * DIRSCAN_ENTRY_SIZE, count - i) << i);
+}
+
+// two 16 byte name prefixes per compare, four per iteration
+__attribute__((target("avx2"))) static uint64_t match_avx2(const uint8_t *entries, unsigned count, const struct dirscan_key &key)
+{
+    const __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)key.bytes));
+    const uint64_t mask = (1u << key.length) - 1;
+    uint64_t match = 0;
+    unsigned i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const uint8_t *e = entries + i * DIRSCAN_ENTRY_SIZE;
+        __m256i names01 = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)e)),
+            _mm_loadu_si128((const __m128i *)(e + DIRSCAN_ENTRY_SIZE)), 1);
+        __m256i names23 = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(e + 2 * DIRSCAN_ENTRY_SIZE))),
+            _mm_loadu_si128((const __m128i *)(e + 3 * DIRSCAN_ENTRY_SIZE)), 1);
+        uint64_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(names01, k)) |
+                      (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(names23, k)) << 32;
+        // an entry matches if all of its compared bytes are equal
+        for (unsigned j = 0; j < 4; ++j)
+        {
+            if (((eq >> (16 * j)) & mask) == mask)
+                match |= 1ULL << (i + j);
+        }
+    }
+    return match | (match_sse2(entries + i * DIRSCAN_ENTRY_SIZE, count - i, key) << i);
+}
+
+#endif // DIRSCAN_X86
+
+struct dirscan_kernel {
+    const char *name;
+    uint64_t (*used)(const uint8_t *entries, unsigned count);
+    uint64_t (*match)(const uint8_t *entries, unsigned count, const struct dirscan_key &key);
+};
+
+static const struct dirscan_kernel kernels[] = {
+    {"scalar", used_scalar, match_scalar},
+#ifdef DIRSCAN_X86
+    {"sse2", used_sse2, match_sse2},
+    {"avx2", used_avx2, match_avx2},
+#endif
+};
+
+static bool supported(int kernel)
+{
+    switch (kernel)
+    {
+    case DIRSCAN_SCALAR:
+        return true;
+#ifdef DIRSCAN_X86
+    case DIRSCAN_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case DIRSCAN_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+static int best_kernel()
+{
+#ifdef DIRSCAN_X86
+    __builtin_cpu_init(); // this runs before the constructors
+#endif
+    for (int kernel = DIRSCAN_AVX2; kernel > DIRSCAN_SCALAR; --kernel)
+    {
+        if (supported(kernel))
+            return kernel;
+    }
+    return DIRSCAN_SCALAR;
+}
+
+static int current = best_kernel();
+
+uint64_t dirscan_used(const uint8_t *entries, unsigned count)
+{
+    return kernels[current].used(entries, count);
+}
+
+uint64_t dirscan_match(const uint8_t *entries, unsigned count, const struct dirscan_key &key)
+{
+    return kernels[current].match(entries, count, key);
+}
+
+bool dirscan_set_kernel(int kernel)
+{
+    if (!supported(kernel))
+        return false;
+    current = kernel;
+    return true;
+}
+
+int dirscan_get_kernel()
+{
+    return current;
+}
+
+const char *dirscan_kernel_name(int kernel)
+{
+    return supported(kernel) ? kernels[kernel].name : "unsupported";
+}
@@ -0,0 +1,37 @@
+#include <cstdint>
+#include <string_view>
+
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+#define DIRSCAN_ENTRY_SIZE 64 // sizeof(struct dir_entry), the name comes first
+#define DIRSCAN_BATCH 64      // entries per scan, one bit each in the result
+#define DIRSCAN_FREE_BATCH 8  // entries per scan when looking for the first free one
+#define DIRSCAN_PREFIX 16     // name bytes the kernels compare
+
+// scan kernels, the best one the CPU supports is picked at startup
+#define DIRSCAN_SCALAR 0
+#define DIRSCAN_SSE2 1
+#define DIRSCAN_AVX2 2
+
+// The first DIRSCAN_PREFIX bytes of a name to look for, with its NUL if
+// it fits. Names that don't fit must be compared in full on a match.
+struct dirscan_key {
+    uint8_t bytes[DIRSCAN_PREFIX];
+    unsigned length; // bytes to compare
+};
+
+void dirscan_make_key(std::string_view name, struct dirscan_key &key);
+
+// Scan up to DIRSCAN_BATCH directory entries and return one bit per entry:
+// dirscan_used sets bit i if entry i has a name, dirscan_match if the name
+// of entry i starts with the key.
+uint64_t dirscan_used(const uint8_t *entries, unsigned count);
+uint64_t dirscan_match(const uint8_t *entries, unsigned count, const struct dirscan_key &key);
+
+// switches the kernel, false if the CPU doesn't support it
+bool dirscan_set_kernel(int kernel);
+int dirscan_get_kernel();
+const char *dirscan_kernel_name(int kernel);
+
+#endif // __DIRSCAN_H__
@@ -1,27 +1,36 @@
 #include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "disk.h"
 
-Disk::Disk()
+Disk::Disk(int backend, const std::string& name) : name(name), backend(backend)
 {
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    if (!disk_file_exists(name)) {
         std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
-        f.write("", 1);
-    }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+        std::cout << "Creating disk file: " << name << std::endl;
+        if (create_image(DEFAULT_NO_BLOCKS, DEFAULT_BLOCK_SIZE) != 0) {
+            std::cerr << "ERROR: Can't create diskfile: " << name << ", exiting..."<< std::endl;
+            exit(-1);
+        }
+    }
+    if (read_header() != 0 || open_backend() != 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
         exit(-1);
     }
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    close_backend();
 }
 
 bool
@@ -30,6 +39,129 @@ Disk::disk_file_exists (const std::string& name) {
     return f.good();
 }
 
+// writes a header for the geometry and sizes the file for it, the
+// blocks are left sparse
+int
+Disk::create_image(unsigned no_blocks, unsigned block_size)
+{
+    int f = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (f < 0)
+        return -1;
+    uint8_t header_block[DISK_HEADER_SIZE] = {0};
+    struct disk_header *header = reinterpret_cast<struct disk_header*>(header_block);
+    memcpy(header->magic, DISK_MAGIC, sizeof(header->magic));
+    header->block_size = block_size;
+    header->no_blocks = no_blocks;
+    uint64_t size = DISK_HEADER_SIZE + (uint64_t)block_size * no_blocks;
+    int ret = 0;
+    if (ftruncate(f, size) != 0 || pwrite(f, header_block, DISK_HEADER_SIZE, 0) != DISK_HEADER_SIZE)
+        ret = -1;
+    close(f);
+    return ret;
+}
+
+// picks up the geometry from the header. A disk file of an older layout
+// gets the default geometry and stays unformatted until format.
+int
+Disk::read_header()
+{
+    std::ifstream f(name, std::ios::binary);
+    struct disk_header header;
+    if (!f.read((char*)&header, sizeof(header)))
+        return -1;
+    data_offset = DISK_HEADER_SIZE;
+    if (memcmp(header.magic, DISK_MAGIC, sizeof(header.magic)) != 0) {
+        no_blocks = DEFAULT_NO_BLOCKS;
+        block_size = DEFAULT_BLOCK_SIZE;
+        formatted = false;
+        return 0;
+    }
+    if (header.block_size < MIN_BLOCK_SIZE || header.block_size > MAX_BLOCK_SIZE || header.no_blocks == 0)
+        return -1;
+    no_blocks = header.no_blocks;
+    block_size = header.block_size;
+    formatted = true;
+    return 0;
+}
+
+int
+Disk::open_backend()
+{
+    if (backend == DISK_MMAP)
+        return open_mapping();
+    if (backend == DISK_URING) {
+        fd = open(name.c_str(), O_RDWR);
+        if (fd < 0)
+            return -1;
+        if (!uring.active() && uring.setup() != 0)
+            std::cout << "io_uring is not available, using preadv/pwritev\n";
+        return 0;
+    }
+    // the disk is simulated as a binary file, vectored I/O goes to the fd
+    diskfile.open(name, std::ios::in | std::ios::out | std::ios::binary);
+    if (!diskfile.is_open())
+        return -1;
+    fd = open(name.c_str(), O_RDWR);
+    return fd < 0 ? -1 : 0;
+}
+
+void
+Disk::close_backend()
+{
+    if (mapping) {
+        sync();
+        munmap(mapping, data_offset + get_disk_size());
+        close(fd);
+        mapping = nullptr;
+        fd = -1;
+        return;
+    }
+    if (diskfile.is_open())
+        diskfile.close();
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+// maps the whole disk file, the file is grown if it is too small
+int
+Disk::open_mapping()
+{
+    fd = open(name.c_str(), O_RDWR);
+    if (fd < 0)
+        return -1;
+    uint64_t map_size = data_offset + get_disk_size();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((uint64_t)st.st_size < map_size && ftruncate(fd, map_size) != 0)) {
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    mapping = static_cast<uint8_t*>(p);
+    return 0;
+}
+
+// recreates the disk file with a new geometry, the content is lost
+int
+Disk::resize(unsigned no_blocks, unsigned block_size)
+{
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        std::cout << "Disk::resize - ERROR: Invalid block size (" << block_size << ")\n";
+        return -1;
+    }
+    close_backend();
+    // drop the old blocks so the file stays sparse
+    if (truncate(name.c_str(), 0) != 0 || create_image(no_blocks, block_size) != 0)
+        return -1;
+    if (read_header() != 0)
+        return -1;
+    return open_backend();
+}
+
 // writes one block to the disk
 int
 Disk::write(unsigned block_no, uint8_t *blk)
@@ -41,10 +173,23 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
+    count_writes(1);
+    uint64_t offset = data_offset + (uint64_t)block_no * block_size;
+    if (mapping) {
+        // in-place, nothing is flushed until sync()
+        if (mapping + offset != blk)
+            memcpy(mapping + offset, blk, block_size);
+        return 0;
+    }
+    if (backend == DISK_URING) {
+        struct iovec iov = {blk, block_size};
+        return io_vector(&iov, 1, offset, true);
+    }
     diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
+    diskfile.write((char*)blk, block_size);
     diskfile.flush();
+    io_calls++;
+    io_blocks++;
     return 0;
 }
 
@@ -56,11 +201,285 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
     if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+        std::cout << "Disk::read - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
+    count_reads(1);
+    uint64_t offset = data_offset + (uint64_t)block_no * block_size;
+    if (mapping) {
+        memcpy(blk, mapping + offset, block_size);
+        return 0;
+    }
+    if (backend == DISK_URING) {
+        struct iovec iov = {blk, block_size};
+        return io_vector(&iov, 1, offset, false);
+    }
     diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    diskfile.read((char*)blk, block_size);
+    io_calls++;
+    io_blocks++;
+    return 0;
+}
+
+// reads one block with pread on the disk file, which any number of
+// threads may do at once, or from the mapping. The fstream backend
+// flushes every write, so the file holds what was written.
+int
+Disk::read_concurrent(unsigned block_no, uint8_t *blk)
+{
+    if (block_no >= no_blocks)
+        return -1;
+    uint64_t offset = data_offset + (uint64_t)block_no * block_size;
+    if (mapping) {
+        memcpy(blk, mapping + offset, block_size);
+        return 0;
+    }
+    size_t done = 0;
+    while (done < block_size) {
+        ssize_t n = pread(fd, blk + done, block_size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
     return 0;
 }
+
+// reads block_nos[i] into blks[i], runs of adjacent blocks are read
+// with a single preadv
+int
+Disk::readv(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks)
+{
+    return transfer(block_nos, blks, false);
+}
+
+// writes blks[i] to block_nos[i], runs of adjacent blocks are written
+// with a single pwritev
+int
+Disk::writev(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks)
+{
+    return transfer(block_nos, blks, true);
+}
+
+int
+Disk::transfer(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks, bool write)
+{
+    if (DEBUG)
+        std::cout << "Disk::" << (write ? "writev(" : "readv(") << block_nos.size() << " blocks)\n";
+    for (unsigned block_no : block_nos) {
+        if (block_no >= no_blocks) {
+            std::cout << "Disk::" << (write ? "writev" : "readv") << " - ERROR: Invalid block number (" << block_no << ")\n";
+            return -1;
+        }
+    }
+    if (write)
+        count_writes(block_nos.size());
+    else
+        count_reads(block_nos.size());
+    if (mapping) {
+        for (size_t i = 0; i < block_nos.size(); ++i) {
+            uint8_t *p = mapping + data_offset + (uint64_t)block_nos[i] * block_size;
+            if (p == blks[i])
+                continue;
+            if (write)
+                memcpy(p, blks[i], block_size);
+            else
+                memcpy(blks[i], p, block_size);
+        }
+        return 0;
+    }
+
+    // split the request into runs of adjacent blocks
+    std::vector<struct iovec> iov(block_nos.size());
+    std::vector<io_run> runs;
+    for (size_t i = 0; i < block_nos.size(); ++i) {
+        iov[i].iov_base = blks[i];
+        iov[i].iov_len = block_size;
+        if (!runs.empty() && runs.back().iov_count < IOV_MAX && block_nos[i] == block_nos[i - 1] + 1) {
+            runs.back().iov_count++;
+            continue;
+        }
+        runs.push_back({i, 1, data_offset + (uint64_t)block_nos[i] * block_size});
+    }
+    if (uring.active())
+        return submit_runs(iov, runs, write);
+    for (const io_run& run : runs) {
+        if (io_vector(&iov[run.first_iov], run.iov_count, run.offset, write) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// one preadv/pwritev, a short transfer continues where it stopped
+int
+Disk::io_vector(struct iovec *v, int count, uint64_t offset, bool write)
+{
+    int blocks = count;
+    while (count > 0) {
+        ssize_t n = write ? pwritev(fd, v, count, offset) : preadv(fd, v, count, offset);
+        io_calls++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        offset += n;
+        while (count > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0) {
+            v->iov_base = (uint8_t*)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    io_blocks += blocks;
+    return 0;
+}
+
+// queues the runs on the ring, as many as fit per submission, and reaps
+// them in a batch. A run that completes short is redone synchronously.
+int
+Disk::submit_runs(std::vector<struct iovec>& iov, const std::vector<io_run>& runs, bool write)
+{
+    std::vector<IoUring::completion> done;
+    size_t next = 0;
+    while (next < runs.size()) {
+        size_t end = std::min(runs.size(), next + uring.get_entries());
+        for (size_t i = next; i < end; ++i)
+            uring.queue(write, fd, &iov[runs[i].first_iov], runs[i].iov_count, runs[i].offset, i);
+        if (uring.submit_and_wait(done) != 0)
+            return -1;
+        io_calls++;
+        for (const IoUring::completion& c : done) {
+            const io_run& run = runs[c.user_data];
+            if (c.res == (int64_t)run.iov_count * block_size) {
+                io_blocks += run.iov_count;
+                continue;
+            }
+            if (io_vector(&iov[run.first_iov], run.iov_count, run.offset, write) != 0)
+                return -1;
+        }
+        next = end;
+    }
+    return 0;
+}
+
+// returns a pointer to the block inside the mapping, or nullptr if
+// the backend can't hand out block pointers (zero-copy access)
+uint8_t *
+Disk::block_ptr(unsigned block_no)
+{
+    if (!mapping || block_no >= no_blocks)
+        return nullptr;
+    return mapping + data_offset + (uint64_t)block_no * block_size;
+}
+
+// copies length bytes from in_fd to out_fd at the given offsets in the
+// kernel. Returns the bytes copied before an error, -1 if none were.
+int64_t
+Disk::copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length)
+{
+    uint64_t done = 0;
+    bool use_sendfile = false;
+    while (done < length) {
+        ssize_t n;
+        if (!use_sendfile) {
+            loff_t in = in_offset + done, out = out_offset + done;
+            n = copy_file_range(in_fd, &in, out_fd, &out, length - done, 0);
+            if (n < 0 && done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                use_sendfile = true;
+                continue;
+            }
+        } else {
+            // sendfile writes at the file position of out_fd, preadv and
+            // pwritev on the disk file don't care about it
+            off_t in = in_offset + done;
+            if (lseek(out_fd, out_offset + done, SEEK_SET) < 0)
+                break;
+            n = sendfile(out_fd, in_fd, &in, length - done);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+        io_calls++;
+    }
+    if (done == 0 && length > 0)
+        return -1;
+    io_blocks += (done + block_size - 1) / block_size;
+    return done;
+}
+
+int64_t
+Disk::copy_in(int in_fd, uint64_t offset, unsigned block_no, uint64_t length)
+{
+    if (DEBUG)
+        std::cout << "Disk::copy_in(" << block_no << ", " << length << ")\n";
+    if (block_no + (length + block_size - 1) / block_size > no_blocks) {
+        std::cout << "Disk::copy_in - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    int64_t n = copy_range(in_fd, offset, fd, data_offset + (uint64_t)block_no * block_size, length);
+    if (n > 0)
+        count_writes((n + block_size - 1) / block_size);
+    return n;
+}
+
+int64_t
+Disk::copy_out(unsigned block_no, uint64_t length, int out_fd, uint64_t offset)
+{
+    if (DEBUG)
+        std::cout << "Disk::copy_out(" << block_no << ", " << length << ")\n";
+    if (block_no + (length + block_size - 1) / block_size > no_blocks) {
+        std::cout << "Disk::copy_out - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    int64_t n = copy_range(fd, data_offset + (uint64_t)block_no * block_size, out_fd, offset, length);
+    if (n > 0)
+        count_reads((n + block_size - 1) / block_size);
+    return n;
+}
+
+// asks the kernel to read runs of adjacent blocks ahead, it returns
+// before they are read
+void
+Disk::prefetch(const std::vector<unsigned>& block_nos)
+{
+    size_t i = 0;
+    while (i < block_nos.size()) {
+        size_t run = 1;
+        while (i + run < block_nos.size() && block_nos[i + run] == block_nos[i] + run)
+            run++;
+        if (block_nos[i] + run <= no_blocks)
+            posix_fadvise(fd, data_offset + (uint64_t)block_nos[i] * block_size, (uint64_t)run * block_size, POSIX_FADV_WILLNEED);
+        i += run;
+    }
+}
+
+// makes all writes durable, msync for the mmap backend and fdatasync
+// for the others, queued on the ring for the uring backend
+int
+Disk::sync()
+{
+    if (DEBUG)
+        std::cout << "Disk::sync()\n";
+    flushes++;
+    if (mapping)
+        return msync(mapping, data_offset + get_disk_size(), MS_SYNC);
+    if (backend == DISK_URING && uring.active()) {
+        // nothing is buffered, the fsync goes through the ring like the I/O
+        std::vector<IoUring::completion> done;
+        if (uring.queue_fsync(fd, 0) != 0 || uring.submit_and_wait(done) != 0)
+            return -1;
+        return done.size() == 1 && done[0].res == 0 ? 0 : -1;
+    }
+    if (backend != DISK_URING) {
+        diskfile.flush();
+        if (!diskfile.good())
+            return -1;
+    }
+    return fdatasync(fd);
+}
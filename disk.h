@@ -1,28 +1,88 @@
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <vector>
+#include "uring.h"
+#include "device.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
-#define BLOCK_SIZE 4096
 #define DEBUG false
 
-class Disk {
+// The geometry is stored in a header in front of the blocks. The magic
+// changes with the on-disk layout, a disk file with another magic or
+// without a header can't be used until it is formatted.
+#define DISK_MAGIC "FSDISK02"
+#define DISK_HEADER_SIZE 4096
+
+struct disk_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t no_blocks;
+};
+
+class Disk : public BlockDevice {
 private:
     std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    std::string name;
+    int backend;
+    int fd = -1;               // preadv/pwritev and the mmap backend
+    uint8_t *mapping = nullptr; // the whole disk file, mmap backend only
+    IoUring uring;              // uring backend only
+    uint64_t data_offset = DISK_HEADER_SIZE; // file offset of block 0
     bool disk_file_exists (const std::string& name);
+    int create_image(unsigned no_blocks, unsigned block_size);
+    int read_header();
+    int open_backend();
+    void close_backend();
+    int open_mapping();
+    // a run of adjacent blocks, iov_count buffers from iov[first_iov]
+    struct io_run {
+        size_t first_iov;
+        int iov_count;
+        uint64_t offset;
+    };
+    int transfer(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks, bool write);
+    int io_vector(struct iovec *iov, int count, uint64_t offset, bool write);
+    int submit_runs(std::vector<struct iovec>& iov, const std::vector<io_run>& runs, bool write);
+    int64_t copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length);
 public:
-    Disk();
+    Disk(int backend = DISK_FSTREAM, const std::string& name = DISKNAME);
     ~Disk();
-    unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    int get_backend() { return backend; }
+    bool uring_active() { return uring.active(); }
+    // recreates the disk file with a new geometry, the content is lost
+    int resize(unsigned no_blocks, unsigned block_size) override;
     // writes one block to the disk
-    int write(unsigned block_no, uint8_t *blk);
+    int write(unsigned block_no, uint8_t *blk) override;
     // reads one block from the disk
-    int read(unsigned block_no, uint8_t *blk);
+    int read(unsigned block_no, uint8_t *blk) override;
+    // reads block_nos[i] into blks[i], runs of adjacent blocks are read
+    // with a single preadv. The uring backend queues all runs and submits
+    // them together.
+    int readv(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks) override;
+    // writes blks[i] to block_nos[i], runs of adjacent blocks are written
+    // with a single pwritev, or queued together on the uring backend
+    int writev(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks) override;
+    // reads one block with pread on the disk file, which any number of
+    // threads may do at once, or from the mapping
+    int read_concurrent(unsigned block_no, uint8_t *blk) override;
+    // returns a pointer to the block inside the mapping, or nullptr if
+    // the backend can't hand out block pointers (zero-copy access)
+    uint8_t *block_ptr(unsigned block_no) override;
+    // copy between a file and the disk file in the kernel, with
+    // copy_file_range, or sendfile where that fails (e.g. across file
+    // systems on older kernels)
+    int64_t copy_in(int fd, uint64_t offset, unsigned block_no, uint64_t length) override;
+    int64_t copy_out(unsigned block_no, uint64_t length, int fd, uint64_t offset) override;
+    // asks the kernel to read runs of adjacent blocks ahead with
+    // posix_fadvise, every backend reads through the page cache
+    void prefetch(const std::vector<unsigned>& block_nos) override;
+    // makes all writes durable, msync for the mmap backend and fdatasync
+    // for the others, queued on the ring for the uring backend
+    int sync() override;
 };
 
 #endif // __DISK_H__
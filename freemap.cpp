@@ -0,0 +1,167 @@
+#include <algorithm>
+#include "freemap.h"
+
+// sizes the map for no_blocks blocks, all of them used
+void FreeMap::reset(unsigned no_blocks)
+{
+    this->no_blocks = no_blocks;
+    free_blocks = 0;
+    levels.clear();
+    uint64_t bits = no_blocks;
+    do
+    {
+        uint64_t words = (bits + 63) / 64;
+        levels.push_back(std::vector<uint64_t>(words, 0));
+        bits = words;
+    } while (bits > 1);
+}
+
+void FreeMap::set_free(unsigned block_no)
+{
+    if (block_no >= no_blocks || is_free(block_no))
+        return;
+    free_blocks++;
+    uint64_t pos = block_no;
+    for (auto &level : levels)
+    {
+        uint64_t &word = level[pos / 64];
+        bool was_empty = (word == 0);
+        word |= 1ULL << (pos % 64);
+        // the summary bit above is only missing if the word was empty
+        if (!was_empty)
+            break;
+        pos /= 64;
+    }
+}
+
+void FreeMap::set_used(unsigned block_no)
+{
+    if (block_no >= no_blocks || !is_free(block_no))
+        return;
+    free_blocks--;
+    uint64_t pos = block_no;
+    for (auto &level : levels)
+    {
+        uint64_t &word = level[pos / 64];
+        word &= ~(1ULL << (pos % 64));
+        // the summary bit above stays set while the word has a free bit
+        if (word != 0)
+            break;
+        pos /= 64;
+    }
+}
+
+// returns the index of the first set bit >= pos on a level, or -1
+int64_t FreeMap::find_from(unsigned level, uint64_t pos)
+{
+    const std::vector<uint64_t> &words = levels[level];
+    uint64_t w = pos / 64;
+    if (w >= words.size())
+        return -1;
+    uint64_t bits = words[w] & (~0ULL << (pos % 64));
+    if (bits)
+        return w * 64 + __builtin_ctzll(bits);
+    if (level + 1 == levels.size())
+        return -1;
+    // ask the level above for the next word with a free bit
+    int64_t next = find_from(level + 1, w + 1);
+    if (next == -1)
+        return -1;
+    return next * 64 + __builtin_ctzll(words[next]);
+}
+
+// returns the first free block >= start, or -1
+int64_t FreeMap::find_free(unsigned start)
+{
+    if (start >= no_blocks)
+        return -1;
+    return find_from(0, start);
+}
+
+// returns the first used block >= start, or no_blocks
+uint64_t FreeMap::find_used(unsigned start)
+{
+    const std::vector<uint64_t> &words = levels[0];
+    uint64_t w = start / 64;
+    if (start >= no_blocks)
+        return no_blocks;
+    // bits past no_blocks are never free, so the last word ends the run
+    uint64_t bits = ~words[w] & (~0ULL << (start % 64));
+    while (bits == 0)
+    {
+        if (++w == words.size())
+            return no_blocks;
+        bits = ~words[w];
+    }
+    return std::min<uint64_t>(w * 64 + __builtin_ctzll(bits), no_blocks);
+}
+
+// reserves count blocks as one contiguous run if possible, preferring
+// runs at or after hint, otherwise in as few extents as possible.
+// Returns -1 and reserves nothing if there aren't enough free blocks.
+int FreeMap::reserve(unsigned count, unsigned hint, std::vector<extent> &extents)
+{
+    extents.clear();
+    if (count == 0)
+        return 0;
+    if (count > free_blocks)
+        return -1;
+    if (hint >= no_blocks)
+        hint = 0;
+
+    // first fit, from hint to the end and then from the start
+    for (int pass = 0; pass < 2 && extents.empty(); ++pass)
+    {
+        uint64_t pos = (pass == 0) ? hint : 0;
+        uint64_t end = (pass == 0) ? no_blocks : hint;
+        while (pos < end)
+        {
+            int64_t start = find_free(pos);
+            if (start == -1 || (uint64_t)start >= end)
+                break;
+            uint64_t run_end = find_used(start);
+            if (run_end - start >= count)
+            {
+                extents.push_back({(uint32_t)start, count});
+                break;
+            }
+            pos = run_end;
+        }
+    }
+
+    if (extents.empty())
+    {
+        // no run is long enough, taking the longest runs first gives the
+        // fewest extents
+        std::vector<extent> runs;
+        uint64_t pos = 0;
+        int64_t start;
+        while ((start = find_free(pos)) != -1)
+        {
+            uint64_t run_end = find_used(start);
+            runs.push_back({(uint32_t)start, (uint32_t)(run_end - start)});
+            pos = run_end;
+        }
+        std::sort(runs.begin(), runs.end(), [](const extent &a, const extent &b)
+                  { return a.length > b.length; });
+        unsigned left = count;
+        for (const extent &run : runs)
+        {
+            if (left == 0)
+                break;
+            unsigned length = std::min(left, run.length);
+            extents.push_back({run.start, length});
+            left -= length;
+        }
+        // lay the extents out in disk order so the file reads forward
+        std::sort(extents.begin(), extents.end(), [](const extent &a, const extent &b)
+                  { return a.start < b.start; });
+    }
+
+    for (const extent &e : extents)
+    {
+        for (uint32_t i = 0; i < e.length; ++i)
+            set_used(e.start + i);
+    }
+    return 0;
+}
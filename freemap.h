@@ -0,0 +1,45 @@
+#include <cstdint>
+#include <vector>
+
+#ifndef __FREEMAP_H__
+#define __FREEMAP_H__
+
+// a run of contiguous blocks
+struct extent {
+    uint32_t start;
+    uint32_t length;
+};
+
+// Hierarchical bitmap of the free blocks, rebuilt from the FAT at mount.
+// Level 0 has one bit per block (1 = free). Every bit of level n+1 tells
+// if the matching 64-bit word of level n has a free block, up to a top
+// level of a single word. Finding the next free block walks up to the
+// first level with a free bit and back down, O(log64 no_blocks).
+class FreeMap {
+private:
+    std::vector<std::vector<uint64_t>> levels;
+    unsigned no_blocks = 0;
+    unsigned free_blocks = 0;
+    int64_t find_from(unsigned level, uint64_t pos);
+public:
+    // sizes the map for no_blocks blocks, all of them used
+    void reset(unsigned no_blocks);
+    void set_free(unsigned block_no);
+    void set_used(unsigned block_no);
+    bool is_free(unsigned block_no)
+    {
+        return (levels[0][block_no / 64] >> (block_no % 64)) & 1;
+    }
+    // returns the first free block >= start, or -1
+    int64_t find_free(unsigned start = 0);
+    // returns the first used block >= start, or no_blocks
+    uint64_t find_used(unsigned start);
+    // reserves count blocks as one contiguous run if possible, preferring
+    // runs at or after hint, otherwise in as few extents as possible.
+    // Returns -1 and reserves nothing if there aren't enough free blocks.
+    int reserve(unsigned count, unsigned hint, std::vector<extent> &extents);
+    unsigned get_free_blocks() { return free_blocks; }
+    unsigned get_no_blocks() { return no_blocks; }
+};
+
+#endif // __FREEMAP_H__
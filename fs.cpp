@@ -2,39 +2,312 @@
 #include "fs.h"
 #include <string>
 #include <cstring>
-#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <cerrno>
+
+// orders entries by name, bytes compared as unsigned like std::string_view
+static bool entry_name_less(const struct dir_entry &a, const struct dir_entry &b)
+{
+    return strcmp(a.file_name, b.file_name) < 0;
+}
+
+// tells if an entry is an inline file, see INLINE_MARK
+static bool is_inline(const struct dir_entry &entry)
+{
+    return (entry.flags & ENTRY_INLINE) && entry.first_blk == ROOT_BLOCK && entry.type == TYPE_FILE;
+}
+
+// number of slots an entry takes, with the data of an inline file
+static unsigned entry_slots(const struct dir_entry &entry)
+{
+    return 1 + (is_inline(entry) ? (entry.size + INLINE_SLOT_DATA - 1) / INLINE_SLOT_DATA : 0);
+}
+
+// tells if a slot holds an entry, not nothing or inline data
+static bool is_entry(const struct dir_entry &entry)
+{
+    return entry.file_name[0] != '\0' && (uint8_t)entry.file_name[0] != INLINE_MARK;
+}
+
+// fills the header entry a B+tree node starts with
+static void set_node_header(struct dir_entry &header, uint8_t type, unsigned first_blk, uint32_t size)
+{
+    memset(&header, 0, sizeof(header));
+    strcpy(header.file_name, NODE_HEADER);
+    header.type = type;
+    header.first_blk = first_blk;
+    header.size = size;
+}
+
+// reads count bytes at offset of a host file, fails on a short read
+static int host_read(int fd, uint8_t *buf, size_t count, uint64_t offset)
+{
+    while (count > 0)
+    {
+        ssize_t n = pread(fd, buf, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        count -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// the throughput of an import or export
+static void print_transfer(const char *what, uint64_t bytes, std::chrono::steady_clock::time_point start,
+                           const char *method)
+{
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    char line[128];
+    snprintf(line, sizeof(line), "%s %llu bytes in %.2f ms, %.1f MB/s (%s)\n", what, (unsigned long long)bytes, ms,
+             bytes / 1e3 / std::max(ms, 1e-3), method);
+    std::cout << line;
+}
+
+// writes count bytes at offset of a host file
+static int host_write(int fd, const uint8_t *buf, size_t count, uint64_t offset)
+{
+    while (count > 0)
+    {
+        ssize_t n = pwrite(fd, buf, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        count -= n;
+        offset += n;
+    }
+    return 0;
+}
 
-FS::FS()
+FS::FS(int disk_backend, unsigned cache_blocks, const std::string &disk_name)
+    : device(open_block_device(disk_backend, disk_name)), cache(*device, cache_blocks)
 {
     std::cout << "FS::FS()... Creating file system\n";
+    set_walk_threads(0);
+    mount();
 }
 
 FS::~FS()
 {
+    sync();
+}
+
+// mount picks up the geometry of the disk and loads the FAT into memory
+int FS::mount()
+{
+    mounted = false;
+    fat.clear();
+    fat_dirty.clear();
+    fat_blocks = 0;
+    if (!device->is_formatted())
+    {
+        std::cerr << "The disk is of an older layout, run format.\n";
+        return -1;
+    }
+    block_size = device->get_block_size();
+    entries_per_block = block_size / sizeof(struct dir_entry);
+    fat.assign(device->get_no_blocks(), FAT_FREE);
+    fat_blocks = (fat.size() * sizeof(fat[0]) + block_size - 1) / block_size;
+    fat_dirty.assign(fat_blocks, false);
+    dir_chains.clear();
+    dentries.clear();
+    dentry_count = 0;
+    dir_links.clear();
+    handles.clear();
+    tails.clear();
+    tail_heads.clear();
+
+    // Read the FAT blocks, the last one may only be partly used
+    std::vector<uint8_t> fat_data(block_size);
+    uint8_t *fat_bytes = reinterpret_cast<uint8_t *>(fat.data());
+    size_t fat_size = fat.size() * sizeof(fat[0]);
+    for (unsigned i = 0; i < fat_blocks; ++i)
+    {
+        if (cache.read(FAT_BLOCK + i, fat_data.data()) != 0)
+        {
+            std::cerr << "Error reading FAT from disk.\n";
+            return -1;
+        }
+        size_t offset = (size_t)i * block_size;
+        memcpy(fat_bytes + offset, fat_data.data(), std::min((size_t)block_size, fat_size - offset));
+    }
+
+    // chains are followed without checks, so an entry that is no block
+    // of the disk means the FAT is broken
+    for (size_t i = 0; i < fat.size(); ++i)
+    {
+        if (fat[i] < FAT_EOF || fat[i] >= (int32_t)fat.size())
+        {
+            std::cerr << "Broken FAT entry for block " << i << ", run format.\n";
+            fat.clear();
+            fat_dirty.clear();
+            fat_blocks = 0;
+            return -1;
+        }
+    }
+
+    // a new disk file or RAM disk has a header but zeroed blocks, format
+    // is what puts "." and ".." into the root directory
+    std::vector<uint8_t> root_data(block_size);
+    const struct dir_entry *root_entries = reinterpret_cast<const struct dir_entry *>(root_data.data());
+    if (cache.read(ROOT_BLOCK, root_data.data()) != 0 || strcmp(root_entries[0].file_name, ".") != 0 ||
+        strcmp(root_entries[1].file_name, "..") != 0 || root_entries[0].type != TYPE_DIR ||
+        root_entries[0].first_blk != ROOT_BLOCK)
+    {
+        std::cerr << "No file system on the disk, run format.\n";
+        fat.clear();
+        fat_dirty.clear();
+        fat_blocks = 0;
+        return -1;
+    }
+    build_free_map();
+    mounted = true;
+    return 0;
+}
+
+// set_fat updates one FAT entry and remembers which FAT block changed
+void FS::set_fat(unsigned block_no, int32_t value)
+{
+    // a link is a reference, block 0 is never linked to
+    if (fat[block_no] > 0 && --block_refs[fat[block_no]] == 1)
+        shared_blocks--;
+    if (value > 0 && ++block_refs[value] == 2)
+        shared_blocks++;
+    fat[block_no] = value;
+    fat_dirty[(size_t)block_no * sizeof(fat[0]) / block_size] = true;
+    if (!tails.empty())
+        drop_tail(block_no);
+    if (value == FAT_FREE)
+        free_map.set_free(block_no);
+    else
+        free_map.set_used(block_no);
+}
+
+// build_free_map rebuilds the free-space bitmap and the block references
+// from the FAT
+void FS::build_free_map()
+{
+    block_refs.assign(fat.size(), 0);
+    shared_blocks = 0;
+    for (int32_t next : fat)
+    {
+        if (next > 0 && ++block_refs[next] == 2)
+            shared_blocks++;
+    }
+    free_map.reset(fat.size());
+    // the root directory and the FAT are reserved even on images that
+    // didn't mark them in the FAT
+    for (unsigned i = FAT_BLOCK + fat_blocks; i < fat.size(); ++i)
+    {
+        if (fat[i] == FAT_FREE)
+            free_map.set_free(i);
+    }
+}
+
+// write_fat writes the FAT blocks changed since the last write_fat
+int FS::write_fat()
+{
+    if (fat_batch)
+        return 0; // written once at the end of the batch
+    std::vector<uint8_t> fat_data(block_size);
+    const uint8_t *fat_bytes = reinterpret_cast<const uint8_t *>(fat.data());
+    size_t fat_size = fat.size() * sizeof(fat[0]);
+    for (unsigned i = 0; i < fat_blocks; ++i)
+    {
+        if (!fat_dirty[i])
+            continue;
+        size_t offset = (size_t)i * block_size;
+        size_t n = std::min((size_t)block_size, fat_size - offset);
+        memcpy(fat_data.data(), fat_bytes + offset, n);
+        memset(fat_data.data() + n, 0, block_size - n);
+        if (cache.write(FAT_BLOCK + i, fat_data.data()) != 0)
+            return -1;
+        fat_dirty[i] = false;
+    }
+    return 0;
 }
 
-// formats the disk, i.e., creates an empty file system
-int FS::format()
+// formats the disk, i.e., creates an empty file system.
+// no_blocks and block_size choose a new geometry, 0 keeps the current one
+int FS::format(unsigned no_blocks, unsigned block_size)
 {
     std::cout << "FS::format()\n";
+    CommandScope scope(this, "format");
+
+    if (no_blocks == 0)
+        no_blocks = device->get_no_blocks();
+    if (block_size == 0)
+        block_size = device->get_block_size();
+    // FAT entries are signed 32 bits, FAT_EOF must not be a block number
+    if (no_blocks > FAT_MAX_BLOCKS)
+    {
+        std::cerr << "Too many blocks, at most " << FAT_MAX_BLOCKS << " are supported.\n";
+        return -1;
+    }
+    // the root directory, the FAT and at least one more block must fit
+    unsigned needed_fat_blocks = ((uint64_t)no_blocks * sizeof(fat[0]) + block_size - 1) / block_size;
+    if (FAT_BLOCK + needed_fat_blocks >= no_blocks)
+    {
+        std::cerr << "Disk too small for the FAT.\n";
+        return -1;
+    }
 
-    // Initialize the FAT
-    fat[0] = ROOT_BLOCK; // root directory
-    fat[1] = FAT_BLOCK;  // FAT
-    for (int i = 2; i < disk.get_no_blocks(); i++)
+    // Resize the disk, everything cached for the old geometry is stale
+    mounted = false;
+    if (device->resize(no_blocks, block_size) != 0)
     {
-        fat[i] = FAT_FREE;
+        std::cerr << "Error resizing the disk.\n";
+        return -1;
     }
+    cache.reset();
+    dir_chains.clear();
+    dentries.clear();
+    dentry_count = 0;
+    dir_links.clear();
+    handles.clear();
+    tails.clear();
+    tail_heads.clear();
+    current_directory_block = ROOT_BLOCK;
+    this->block_size = block_size;
+    entries_per_block = block_size / sizeof(struct dir_entry);
+    fat.assign(no_blocks, FAT_FREE);
+    block_refs.assign(no_blocks, 0);
+    shared_blocks = 0;
+    fat_blocks = (fat.size() * sizeof(fat[0]) + block_size - 1) / block_size;
+    // a fresh FAT is written out completely
+    fat_dirty.assign(fat_blocks, true);
+
+    // Initialize the FAT, the root directory and the FAT itself are
+    // reserved, the FAT blocks form a chain
+    set_fat(ROOT_BLOCK, FAT_EOF); // root directory
+    for (unsigned i = 0; i < fat_blocks; ++i)
+    {
+        set_fat(FAT_BLOCK + i, (i + 1 < fat_blocks) ? FAT_BLOCK + i + 1 : FAT_EOF);
+    }
+    build_free_map();
 
     // Write FAT to disk
-    if (disk.write(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat)) != 0)
+    if (write_fat() != 0)
     {
         std::cerr << "Error writing FAT to disk.\n";
         return -1; // or other appropriate error code
     }
 
     // Initialize root directory with "." and ".." entries
-    struct dir_entry root_entries[BLOCK_SIZE / sizeof(struct dir_entry)] = {0};
+    std::vector<uint8_t> root_data(block_size);
+    struct dir_entry *root_entries = reinterpret_cast<struct dir_entry *>(root_data.data());
     strcpy(root_entries[0].file_name, "."); // Current directory
     root_entries[0].size = 0;
     root_entries[0].first_blk = ROOT_BLOCK;
@@ -48,1316 +321,2950 @@ int FS::format()
     root_entries[1].access_rights = READ | WRITE | EXECUTE;
 
     // Write the initialized root directory to disk
-    if (disk.write(ROOT_BLOCK, reinterpret_cast<uint8_t *>(root_entries)) != 0)
+    if (cache.write(ROOT_BLOCK, root_data.data()) != 0)
     {
         std::cerr << "Error writing root directory to disk.\n";
         return -1; // or other appropriate error code
     }
 
-    // Additional logic to reset or prepare the disk file, if needed
-    // ...
+    // Make the new file system durable before anything else touches it
+    sync();
+    mounted = true;
 
     return 0;
 }
 
 // create <filepath> creates a new file on the disk, the data content is
 // written on the following rows (ended with an empty row)
-int FS::create(std::string filepath)
+int FS::create(const std::string &filepath)
 {
     std::cout << "FS::create(" << filepath << ")\n";
+    CommandScope scope(this, "create");
 
-    // 1. Resolve the path
-    std::vector<std::string> pathParts = resolve_path(filepath);
-    if (pathParts.empty())
+    // 1. Find the directory the file goes in
+    unsigned currentBlock;
+    std::string_view filename;
+    if (walk_path(filepath, currentBlock, filename) != 0)
+        return -1;
+    if (filename.empty())
     {
         std::cerr << "Invalid path." << std::endl;
         return -1;
     }
-
-    // 2. Navigate to the correct directory
-    unsigned int currentBlock = current_directory_block;
-    struct dir_entry *dirEntry = nullptr;
-    for (size_t i = 0; i < pathParts.size() - 1; ++i)
-    { // Navigate through intermediate directories
-        dirEntry = find_directory_entry(pathParts[i]);
-        if (dirEntry == nullptr || dirEntry->type != TYPE_DIR)
-        {
-            std::cerr << "Directory not found: " << pathParts[i] << "\n";
-            return -1;
-        }
-        currentBlock = dirEntry->first_blk; // Move to the next directory in the path
-    }
-
-    // Now, currentBlock is where the file should be created
-    uint8_t dir_data[BLOCK_SIZE];
-    disk.read(currentBlock, dir_data);
-    struct dir_entry *dir_entries = reinterpret_cast<struct dir_entry *>(dir_data);
-
-    // Check if the directory has write permission
-    if (!(dir_entries[0].access_rights & WRITE))
-    { // Assuming the first entry [0] is the directory itself
-        std::cerr << "Write permission denied for directory: " << pathParts[pathParts.size() - 2] << "\n";
+    if (!name_fits(filename))
         return -1;
-    }
 
-    std::string filename = pathParts.back(); // The last part is the filename
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    // Check if the directory has write permission
+    if (!(dir_rights(currentBlock) & WRITE))
     {
-        if (std::string(dir_entries[i].file_name) == filename)
-        {
-            std::cerr << "File already exists: " << filename << std::endl;
-            return -1;
-        }
-    }
-    // 1. Find a free block (correct position)
-    int free_block = -1;
-    for (int i = 2; i < disk.get_no_blocks(); ++i)
-    { // start from 2 because 0 and 1 are reserved
-        if (fat[i] == FAT_FREE)
-        {
-            free_block = i;
-            break;
-        }
+        std::cerr << "Write permission denied for directory: " << filepath << "\n";
+        return -1;
     }
 
-    // If no free blocks found, return error.
-    if (free_block == -1)
+    struct dir_entry existing;
+    if (dir_lookup(currentBlock, filename, existing) == 0)
     {
-        std::cerr << "No free blocks available." << std::endl;
+        std::cerr << "File already exists: " << filename << std::endl;
         return -1;
     }
-    // 2. Create the file (correct position)
-    struct dir_entry new_entry;
-    strncpy(new_entry.file_name, filename.c_str(), sizeof(new_entry.file_name));
-    new_entry.first_blk = free_block;
-    new_entry.size = 0; // will be updated as we write content
-    new_entry.type = TYPE_FILE;
-    new_entry.access_rights = READ | WRITE; // default rights
 
-    // 4. Write content to file until an empty row is detected
+    // 1. Read the content until an empty row is detected, the lines are
+    // stored back to back as C-strings
+    std::string content;
     std::string input_line;
-    uint8_t buffer[BLOCK_SIZE] = {0};
-    int buffer_offset = 0;
     while (true)
     {
         std::getline(std::cin, input_line);
         if (input_line.empty())
             break; // Stop if input is an empty row
-
-        // If this line won't fit in the current buffer, write current buffer to disk
-        if (buffer_offset + input_line.size() + 1 > BLOCK_SIZE)
-        {
-            disk.write(free_block, buffer);
-            memset(buffer, 0, BLOCK_SIZE); // Clear buffer
-            buffer_offset = 0;
-
-            // 5. Handle the case where the file spans multiple blocks.
-            // Find another free block
-            int next_free_block = -1;
-            for (int i = free_block + 1; i < disk.get_no_blocks(); ++i)
-            {
-                if (fat[i] == FAT_FREE)
-                {
-                    next_free_block = i;
-                    break;
-                }
-            }
-            if (next_free_block == -1)
-            {
-                std::cerr << "Out of disk space while writing file content." << std::endl;
-                return -1;
-            }
-
-            // Update FAT
-            fat[free_block] = next_free_block;
-            free_block = next_free_block;
-        }
-
-        // Copy line to buffer and adjust offset
-        memcpy(buffer + buffer_offset, input_line.c_str(), input_line.size());
-        buffer_offset += input_line.size() + 1; // +1 for null terminator
-        new_entry.size += input_line.size() + 1;
+        content.append(input_line.c_str(), input_line.size() + 1); // +1 for null terminator
     }
 
-    // Write the remaining buffer to disk
-    if (buffer_offset > 0)
+    // 2. Create the file
+    struct dir_entry new_entry;
+    memset(&new_entry, 0, sizeof(new_entry));
+    set_entry_name(new_entry, filename);
+    new_entry.size = content.size();
+    new_entry.type = TYPE_FILE;
+    new_entry.access_rights = READ | WRITE; // default rights
+
+    // 3. A small file stays inline in the directory block. The others get
+    // all their blocks in one go, as few extents as possible, and their
+    // content is written along the chain
+    std::vector<unsigned> blocks;
+    if (fits_inline(content.size()))
     {
-        disk.write(free_block, buffer);
+        new_entry.flags = ENTRY_INLINE;
+        new_entry.first_blk = ROOT_BLOCK;
     }
-
-    // Set the FAT entry for the last block to EOF
-    fat[free_block] = FAT_EOF;
-
-    // Update the directory (not necessarily the root) with the new entry
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    else
     {
-        if (dir_entries[i].file_name[0] == '\0')
-        { // Check for empty slot
-            dir_entries[i] = new_entry;
-            break;
+        unsigned no_file_blocks = std::max<size_t>(1, (content.size() + block_size - 1) / block_size);
+        if (allocate_chain(no_file_blocks, 0, blocks) != 0)
+        {
+            std::cerr << "No free blocks available." << std::endl;
+            return -1;
         }
+        new_entry.first_blk = blocks[0];
+        if (write_chain(blocks, (uint8_t *)&content[0], content.size()) != 0)
+            return -1;
     }
 
-    // Write back the updated directory and FAT to the disk
-    disk.write(currentBlock, dir_data); // Use currentBlock instead of current_directory_block
-    disk.write(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
+    // 4. Add the new entry to the directory (not necessarily the root), it
+    // grows if the bucket is full
+    if (dir_insert(currentBlock, new_entry, (const uint8_t *)content.data()) != 0)
+    {
+        std::cerr << "Directory full: " << filename << std::endl;
+        if (!blocks.empty())
+            free_chain(blocks[0]);
+        write_fat();
+        return -1;
+    }
+    write_fat();
 
     return 0;
 }
 
-int FS::cat(std::string filepath)
+int FS::cat(const std::string &filepath)
 {
     std::cout << "FS::cat(" << filepath << ")\n";
+    CommandScope scope(this, "cat");
 
-    // 1. Resolve the path
-    std::vector<std::string> pathParts = resolve_path(filepath);
-    if (pathParts.empty())
-    {
-        std::cerr << "Invalid path.\n";
+    // 1. Open the file, which checks that it may be read
+    int fd = open(filepath, READ);
+    if (fd < 0)
         return -1;
-    }
 
-    // 2. Find the directory entry of the file
-    unsigned int currentBlock = current_directory_block;
-    struct dir_entry *dirEntry = nullptr;
-    for (size_t i = 0; i < pathParts.size() - 1; ++i)
-    { // Navigate through intermediate directories
-        dirEntry = find_directory_entry(pathParts[i]);
-        if (dirEntry == nullptr || dirEntry->type != TYPE_DIR)
+    // 2. Read it a batch of blocks at a time, an inline file is in its
+    // directory block. The content is a sequence of C-strings which may
+    // continue in the next batch
+    std::vector<uint8_t> chunk(std::clamp<size_t>(handles[fd].entry.size, 1, (size_t)CHAIN_BATCH_BLOCKS * block_size));
+    std::string line;
+    int64_t n;
+    while ((n = read(fd, chunk.data(), chunk.size())) > 0)
+    {
+        // Print every completed string
+        const char *ptr = (const char *)chunk.data();
+        const char *end = ptr + n;
+        while (ptr < end)
         {
-            std::cerr << "Directory not found: " << pathParts[i] << "\n";
-            return -1;
+            const char *nul = (const char *)memchr(ptr, '\0', end - ptr);
+            if (nul == nullptr)
+            { // continues in the next batch
+                line.append(ptr, end - ptr);
+                break;
+            }
+            line.append(ptr, nul - ptr);
+            std::cout << line << std::endl;
+            line.clear();
+            ptr = nul + 1;
         }
-        currentBlock = dirEntry->first_blk; // Move to the next directory in the path
-    }
-
-    // Now, currentBlock is where the file should be
-    uint8_t dir_data[BLOCK_SIZE];
-    disk.read(currentBlock, dir_data);
-    struct dir_entry *dir_entries = reinterpret_cast<struct dir_entry *>(dir_data);
-    int fileIndex = find_directory_entry(pathParts.back(), dir_entries); // Find the file in the directory
-    if (fileIndex == -1)
-    {
-        std::cerr << "File not found: " << pathParts.back() << "\n";
-        return -1;
     }
-
-    dirEntry = &dir_entries[fileIndex]; // Get the directory entry of the file
-
-    // Check if the file has read permission
-    if (!(dirEntry->access_rights & READ))
-    {
-        std::cerr << "Read permission denied for file: " << pathParts.back() << "\n";
+    close(fd);
+    if (n < 0)
         return -1;
-    }
-
-    // 3. Read the FAT
-    disk.read(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
-
-    // Reuse currentBlock for reading the file content
-    currentBlock = dirEntry->first_blk; // Make sure the type of currentBlock can accommodate this value
-    while (currentBlock != FAT_EOF)
-    {
-        uint8_t block_data[BLOCK_SIZE];
-        disk.read(currentBlock, block_data);
-
-        // Print the content of the block as C-strings
-        char *ptr = (char *)block_data;
-        while (*ptr)
-        {                                  // Loop until we hit a null character
-            std::cout << ptr << std::endl; // Print the string
-            ptr += strlen(ptr) + 1;        // Move to the next string in the block
-        }
-
-        currentBlock = fat[currentBlock]; // This may need type casting if types are not compatible
-    }
+    if (!line.empty())
+        std::cout << line << std::endl;
     return 0;
 }
 
 // ls lists the content in the current directory (files and sub-directories)
-int FS::ls()
+int FS::ls(const std::string &prefix, const std::string &after, unsigned count)
 {
     std::cout << "FS::ls()\n";
+    CommandScope scope(this, "ls");
 
-    // 1. Read the current directory from disk
-    uint8_t current_dir_data[BLOCK_SIZE];
-    disk.read(current_directory_block, current_dir_data); // Changed from ROOT_BLOCK
-    struct dir_entry *current_dir_entries = reinterpret_cast<struct dir_entry *>(current_dir_data);
-
-    // 2. Iterate over all entries and print details
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    // Print the details of an entry
+    auto print = [](const struct dir_entry &e)
     {
-        struct dir_entry *entry = &current_dir_entries[i];
-        if (entry->file_name[0] != '\0')
-        { // valid entry
-            std::cout << entry->file_name << "\t";
-            // TYPE
-            if (entry->type == TYPE_DIR)
-            {
-                std::cout << "dir\t";
-            }
-            else
-            {
-                std::cout << "file\t";
-            }
+        const struct dir_entry *entry = &e;
+        std::cout << entry->file_name << "\t";
+        // TYPE
+        if (entry->type == TYPE_DIR)
+        {
+            std::cout << "dir\t";
+        }
+        else
+        {
+            std::cout << "file\t";
+        }
 
-            // ACCESS RIGHTS
-            if (entry->access_rights & 0x04)
-            {
-                std::cout << "r";
-            }
-            else
-            {
-                std::cout << "-";
-            }
+        // ACCESS RIGHTS
+        if (entry->access_rights & 0x04)
+        {
+            std::cout << "r";
+        }
+        else
+        {
+            std::cout << "-";
+        }
 
-            if (entry->access_rights & 0x02)
-            {
-                std::cout << "w";
-            }
-            else
-            {
-                std::cout << "-";
-            }
+        if (entry->access_rights & 0x02)
+        {
+            std::cout << "w";
+        }
+        else
+        {
+            std::cout << "-";
+        }
 
-            if (entry->access_rights & 0x01)
-            {
-                std::cout << "x\t";
-            }
-            else
-            {
-                std::cout << "-\t";
-            }
+        if (entry->access_rights & 0x01)
+        {
+            std::cout << "x\t";
+        }
+        else
+        {
+            std::cout << "-\t";
+        }
 
-            // SIZE
-            if (entry->size == 0 || entry->type == TYPE_DIR)
-            {
-                std::cout << "-\n";
-            }
-            else
-            {
-                std::cout << entry->size << "\n";
-            }
+        // SIZE
+        if (entry->size == 0 || entry->type == TYPE_DIR)
+        {
+            std::cout << "-\n";
         }
-    }
-    return 0;
+        else
+        {
+            std::cout << entry->size << "\n";
+        }
+        return true;
+    };
+
+    // A plain listing of a hashed directory comes in slot order
+    if (prefix.empty() && after.empty() && count == 0 && !dir_btree(current_directory_block))
+        return dir_for_each(current_directory_block, print);
+
+    unsigned listed = 0;
+    std::string last;
+    bool more = false;
+    int ret = dir_list(current_directory_block, prefix, after, [&](const struct dir_entry &e)
+                       {
+        if (count != 0 && listed == count)
+        {
+            more = true;
+            return false;
+        }
+        listed++;
+        last = e.file_name;
+        return print(e); });
+    // the next page starts after the last name
+    if (ret == 0 && more)
+        std::cout << "more after " << last << "\n";
+    return ret;
 }
 
 // cp <sourcepath> <destpath> makes an exact copy of the file
 // <sourcepath> to a new file <destpath>
 
-int FS::cp(std::string sourcepath, std::string destpath)
+int FS::cp(const std::string &sourcepath, const std::string &destpath, bool reflink)
 {
     std::cout << "FS::cp()\n";
+    CommandScope scope(this, "cp");
 
-    // Resolve paths to their components
-    std::vector<std::string> sourcePathParts = resolve_path_for_cp_and_mv(sourcepath);
-    std::vector<std::string> destPathParts = resolve_path_for_cp_and_mv(destpath);
-
-    std::cout << "Resolved source path parts: ";
-    for (const auto &part : sourcePathParts)
-        std::cout << part << " ";
-    std::cout << std::endl;
-
-    std::cout << "Resolved destination path parts: ";
-    for (const auto &part : destPathParts)
-        std::cout << part << " ";
-    std::cout << std::endl;
-
-    // Backup the current directory block for restoration later
-    unsigned int backupCurrentDirectoryBlock = current_directory_block;
-
-    // Find the directory entry for the source file
-    unsigned int currentBlock = current_directory_block;
-    struct dir_entry *sourceDirEntry = nullptr;
-    // Traverse the path but stop before the last component
-    // Traverse the source path but stop before the last component (the actual file)
-    for (int i = 0; i < sourcePathParts.size() - 1; ++i)
-    {
-        const auto &part = sourcePathParts[i];
-        current_directory_block = currentBlock; // Update current directory
-        std::cout << "Traversing source path. Current directory block: " << current_directory_block << ", Looking for part: " << part << std::endl;
-        sourceDirEntry = find_directory_entry(part);
-        if (sourceDirEntry == nullptr || sourceDirEntry->type != TYPE_DIR)
-        {
-            std::cerr << "Intermediate path invalid or not a directory: " << part << "\n";
-            current_directory_block = backupCurrentDirectoryBlock;
-            return -1;
-        }
-        std::cout << "Found directory: " << part << ", Block: " << sourceDirEntry->first_blk << std::endl;
-        currentBlock = sourceDirEntry->first_blk;
-    }
+    // Open the source file
+    int source = open(sourcepath, READ);
+    if (source < 0)
+        return -1;
+    struct dir_entry sourceFile = handles[source].entry;
+    std::string_view sourceName = sourceFile.file_name;
 
-    // Handle the last part of the path which should be the file
-    current_directory_block = currentBlock; // Update current directory
-    sourceDirEntry = find_directory_entry(sourcePathParts.back());
-    if (sourceDirEntry == nullptr || sourceDirEntry->type != TYPE_FILE)
+    // Find the directory where the file should be copied
+    unsigned currentBlock;
+    std::string_view destFileName;
+    if (walk_path(destpath, currentBlock, destFileName) != 0)
     {
-        std::cerr << "Source file not found or is a directory.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
+        close(source);
         return -1;
     }
-    currentBlock = sourceDirEntry->first_blk;
 
-    // Reading the source file
-    uint8_t current_dir_data[BLOCK_SIZE];
-    disk.read(current_directory_block, current_dir_data); // Reading the current directory
-    struct dir_entry *dir_entries = reinterpret_cast<struct dir_entry *>(current_dir_data);
-    int sourceIndex = find_directory_entry(sourcepath, dir_entries); // Directly using sourcepath
-    if (sourceIndex == -1)
+    // Determine if the destination path is a directory or a filename
+    struct dir_entry destEntry;
+    if (destFileName.empty())
     {
-        std::cerr << "Source file not found.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
-        return -1;
+        destFileName = sourceName; // "/" or "."
     }
-    dir_entry sourceFile = dir_entries[sourceIndex];
-
-    // Read Source File Content
-    uint32_t sourceSize = sourceFile.size;
-    uint8_t *sourceData = new uint8_t[sourceSize];
-    currentBlock = sourceFile.first_blk; // Reuse currentBlock here
-    int bytesRead = 0;
-    while (bytesRead < sourceSize)
+    else if (dir_lookup(currentBlock, destFileName, destEntry) == 0 && destEntry.type == TYPE_DIR)
     {
-        uint8_t tempData[BLOCK_SIZE];
-        disk.read(currentBlock, tempData);
-
-        for (int i = 0; (i < BLOCK_SIZE) && (bytesRead < sourceSize); ++i)
-        {
-            sourceData[bytesRead++] = tempData[i];
-        }
-
-        currentBlock = fat[currentBlock];
+        // If destination is a directory, use the source file's name as the new file's name
+        currentBlock = destEntry.first_blk; // Change to the destination directory's block
+        destFileName = sourceName;          // Use source file name for the new file in the destination directory
     }
-    // Output the source file content (optional, for debugging)
-    std::cout << "Source file content: ";
-    for (int i = 0; i < sourceSize; i++)
+    if (!name_fits(destFileName))
     {
-        std::cout << sourceData[i];
+        close(source);
+        return -1;
     }
-    std::cout << std::endl;
 
-    // Restore the original current directory block
-    current_directory_block = backupCurrentDirectoryBlock;
-
-    currentBlock = (destPathParts[0] == "/") ? ROOT_BLOCK : current_directory_block; // Start from root if path is absolute
-    struct dir_entry *destDirEntry = nullptr;
-    std::string destFileName = destPathParts.back(); // Extract the filename from the destination path
-    destPathParts.pop_back();                        // Remove the filename part, leaving only the directory path
-
-    // Traverse the destination path to find the directory where the file should be copied
-    for (const auto &part : destPathParts)
+    // Check if the destination file already exists in the destination directory
+    if (dir_lookup(currentBlock, destFileName, destEntry) == 0)
     {
-        current_directory_block = currentBlock; // Update current directory
-        std::cout << "Traversing destination path. Current directory block: " << current_directory_block << ", Looking for part: " << part << std::endl;
-        destDirEntry = find_directory_entry(part);
-        if (destDirEntry == nullptr)
-        {
-            std::cerr << "Destination path invalid or directory does not exist: " << part << "\n";
-            delete[] sourceData; // Clean up memory
-            current_directory_block = backupCurrentDirectoryBlock;
-            return -1;
-        }
-        std::cout << "Found directory: " << part << ", Block: " << destDirEntry->first_blk << std::endl;
-        currentBlock = destDirEntry->first_blk;
+        std::cerr << "Destination file already exists: " << destFileName << std::endl;
+        close(source);
+        return -1; // File already exists
     }
 
-    // Reading the destination directory
-    disk.read(currentBlock, current_dir_data);
-    dir_entries = reinterpret_cast<struct dir_entry *>(current_dir_data);
-
-    // Determine if the destination path is a directory or a filename
-    bool destIsDirectory = false;
-    int dirIndex = -1; // Index of the destination directory in its parent directory
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); i++)
+    // A reflink takes the blocks of the source as they are, an inline
+    // file has none and is copied
+    if (reflink && !is_inline(sourceFile))
     {
-        if (strcmp(dir_entries[i].file_name, destFileName.c_str()) == 0)
-        {
-            if (dir_entries[i].type == TYPE_DIR)
-            {
-                // Destination path is a directory, set flag
-                destIsDirectory = true;
-                dirIndex = i;
-                break;
-            }
-        }
+        close(source);
+        return add_reflink(sourceFile, currentBlock, destFileName);
     }
 
-    if (destIsDirectory)
+    // The copy starts empty with the rights of the source and grows a
+    // batch of blocks at a time, right after its last block if possible
+    int dest = open_new(currentBlock, destFileName, sourceFile.access_rights);
+    if (dest < 0)
     {
-        // If destination is a directory, use the source file's name as the new file's name
-        currentBlock = dir_entries[dirIndex].first_blk; // Change to the destination directory's block
-        disk.read(currentBlock, current_dir_data);      // Read the destination directory
-        dir_entries = reinterpret_cast<struct dir_entry *>(current_dir_data);
-        destFileName = sourcePathParts.back(); // Use source file name for the new file in the destination directory
+        close(source);
+        return -1;
     }
+    // Output the source file content (optional, for debugging) as it
+    // streams through
+    std::cout << "Source file content: ";
+    int ret = stream(source, dest, sourceFile.size, &std::cout);
+    std::cout << std::endl;
 
-    // Check if the destination file already exists in the destination directory
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); i++)
+    // A copy that failed halfway goes again
+    if (ret != 0)
     {
-        if (strcmp(dir_entries[i].file_name, destFileName.c_str()) == 0)
+        std::cerr << "Cannot copy file.\n";
+        struct open_file &h = handles[dest];
+        if (handle_entry(h) == 0)
         {
-            std::cerr << "Destination file already exists: " << destFileName << std::endl;
-            delete[] sourceData; // Clean up memory
-            current_directory_block = backupCurrentDirectoryBlock;
-            return -1; // File already exists
+            if (!is_inline(h.entry))
+                free_chain(h.entry.first_blk);
+            dir_remove(h.slot);
+            write_fat();
         }
     }
+    close(source);
+    close(dest);
+    return ret;
+}
+
 
-    int destIndex = find_free_directory_entry(dir_entries);
-    if (destIndex == -1)
+int FS::mv(const std::string &sourcepath, const std::string &destpath)
+{
+    std::cout << "FS::mv()\n";
+    CommandScope scope(this, "mv");
+
+    // Find the directory entry for the source file
+    unsigned sourceBlock;
+    std::string_view sourceName;
+    if (walk_path(sourcepath, sourceBlock, sourceName) != 0)
+        return -1;
+
+    // Check write permission on the source directory (for delete)
+    if (!(dir_rights(sourceBlock) & WRITE))
     {
-        std::cerr << "Directory full. Cannot copy file.\n";
-        delete[] sourceData; // Clean up memory
-        current_directory_block = backupCurrentDirectoryBlock;
+        std::cerr << "Write permission denied for source directory.\n";
         return -1;
     }
 
-    int destFirstBlock = find_free_fat_entry();
-    if (destFirstBlock == -1)
+    struct dir_entry sourceEntry;
+    struct dir_slot sourceSlot;
+    if (sourceName.empty() || sourceName == ".." ||
+        dir_lookup(sourceBlock, sourceName, sourceEntry, &sourceSlot) != 0)
     {
-        std::cerr << "No free blocks. Cannot copy file.\n";
-        delete[] sourceData; // Clean up memory
+        std::cerr << "Source file not found.\n";
         return -1;
     }
 
-    int currentFreeBlock = destFirstBlock;
-    bytesRead = 0; // reset bytesRead for writing purposes
-    while (bytesRead < sourceSize)
+    // Find the directory for the destination path, a destination that is
+    // a directory gets the entry under its source name
+    unsigned currentBlock;
+    std::string_view destFileName;
+    if (walk_path(destpath, currentBlock, destFileName) != 0)
+        return -1;
+    struct dir_entry destEntry;
+    if (destFileName.empty())
     {
-        if (fat[currentFreeBlock] == FAT_FREE)
-        {
-            fat[currentFreeBlock] = FAT_EOF;
+        destFileName = sourceName; // "/" or "."
+    }
+    else if (dir_lookup(currentBlock, destFileName, destEntry) == 0 && destEntry.type == TYPE_DIR)
+    {
+        currentBlock = destEntry.first_blk;
+        destFileName = sourceName;
+    }
+    if (!name_fits(destFileName))
+        return -1;
 
-            // Write data to this block
-            uint8_t tempData[BLOCK_SIZE];
-            for (int j = 0; (j < BLOCK_SIZE) && (bytesRead < sourceSize); ++j)
-            {
-                tempData[j] = sourceData[bytesRead++];
-            }
-            disk.write(currentFreeBlock, tempData);
+    // Now, currentBlock is where the destination directory is
+    // Check if the destination file already exists
+    if (dir_lookup(currentBlock, destFileName, destEntry) == 0)
+    {
+        std::cerr << "Destination file already exists: " << destFileName << std::endl;
+        return -1; // File already exists
+    }
+
+    // Check write permission on the destination directory (for add)
+    if (!(dir_rights(currentBlock) & WRITE))
+    {
+        std::cerr << "Write permission denied for destination directory.\n";
+        return -1;
+    }
 
-            if (bytesRead == sourceSize)
+    // A directory can't move below itself, the way up from the
+    // destination to the root must not pass it
+    if (sourceEntry.type == TYPE_DIR)
+    {
+        size_t depth = 0;
+        for (unsigned block = currentBlock; block != ROOT_BLOCK; ++depth)
+        {
+            if (block == sourceEntry.first_blk)
             {
-                break;
+                std::cerr << "Cannot move a directory into itself.\n";
+                return -1;
             }
-
-            // Find next free block in FAT for next iteration
-            currentFreeBlock = find_free_fat_entry(currentFreeBlock + 1);
-            if (currentFreeBlock == -1)
+            const struct dir_link *link = get_dir_link(block);
+            // a directory deeper than the disk has blocks is a loop
+            if (link == nullptr || depth >= fat.size())
             {
-                std::cerr << "No more free blocks during copy.\n";
-                delete[] sourceData; // Clean up memory
+                std::cerr << "Error: Directory name not found.\n";
                 return -1;
             }
+            block = link->parent;
         }
     }
 
-    // Update directory entry for the destination
-    dir_entries[destIndex] = sourceFile;
-    strncpy(dir_entries[destIndex].file_name, destFileName.c_str(), sizeof(dir_entries[destIndex].file_name) - 1); // Use destFileName here
-    dir_entries[destIndex].first_blk = destFirstBlock;
-    dir_entries[destIndex].size = sourceSize;
-
-    // Update Directory and FAT
-    disk.write(currentBlock, current_dir_data); // Write to the actual destination directory
-
-    // Assuming your FAT is just a single block.
-    // If it's more than one block, this needs adjustments.
-    uint8_t fat_data[BLOCK_SIZE];
-    memcpy(fat_data, fat, BLOCK_SIZE);
-    disk.write(FAT_BLOCK, fat_data);
+    // The bucket depends on the name, so renaming in the same directory is
+    // a move as well. The old entry goes first, the insert may split its
+    // bucket. An inline file takes its data along.
+    std::vector<uint8_t> inlineData;
+    if (is_inline(sourceEntry) && read_inline(sourceSlot, sourceEntry.size, inlineData) != 0)
+        return -1;
+    destEntry = sourceEntry;
+    set_entry_name(destEntry, destFileName);
+    dir_remove(sourceSlot);
+    if (dir_insert(currentBlock, destEntry, inlineData.data()) != 0)
+    {
+        std::cerr << "Destination directory is full. Cannot move file.\n";
+        dir_insert(sourceBlock, sourceEntry, inlineData.data()); // put it back
+        write_fat();
+        return -1;
+    }
+    write_fat();
 
-    delete[] sourceData; // Clean up memory
+    if (sourceEntry.type != TYPE_DIR)
+        return 0;
+    dir_links[sourceEntry.first_blk] = {currentBlock, std::string(destFileName)};
 
-    // Restore the original current directory block before returning
-    current_directory_block = backupCurrentDirectoryBlock;
+    // A directory that changed parents points its ".." at the new one
+    struct dir_entry parent;
+    struct dir_slot parentSlot;
+    if (currentBlock != sourceBlock &&
+        dir_lookup(sourceEntry.first_blk, "..", parent, &parentSlot) == 0)
+    {
+        parent.first_blk = currentBlock;
+        dir_update(parentSlot, parent);
+    }
     return 0;
 }
 
-int FS::mv(std::string sourcepath, std::string destpath)
+// rm <filepath> removes / deletes the file <filepath>, with recursive a
+// directory and everything below it
+int FS::rm(const std::string &filepath, bool recursive)
 {
-    std::cout << "FS::mv()\n";
-
-    // 1. Resolve paths to their components
-    std::vector<std::string> sourcePathParts = resolve_path(sourcepath);
-    std::vector<std::string> destPathParts = resolve_path(destpath);
-
-    // Backup the current directory block for restoration later
-    unsigned int backupCurrentDirectoryBlock = current_directory_block;
+    std::cout << "FS::rm()\n";
+    CommandScope scope(this, "rm");
 
-    // Find the directory entry for the source file
-    unsigned int currentBlock = (sourcepath[0] == '/') ? ROOT_BLOCK : current_directory_block;
-    struct dir_entry *sourceDirEntry = nullptr;
-    for (const auto &part : sourcePathParts)
+    // Find the directory of the file/directory to be removed
+    unsigned currentBlock;
+    std::string_view targetName; // The last part is the name of the file/directory to be removed
+    if (walk_path(filepath, currentBlock, targetName) != 0)
+        return -1;
+    if (targetName.empty() || targetName == "..")
     {
-        current_directory_block = currentBlock; // Update current directory
-        sourceDirEntry = find_directory_entry(part);
-        if (sourceDirEntry == nullptr || (sourceDirEntry->type != TYPE_DIR && part != sourcePathParts.back()))
-        {
-            std::cerr << "Source path invalid or not a directory.\n";
-            current_directory_block = backupCurrentDirectoryBlock;
-            return -1;
-        }
-        if (part != sourcePathParts.back())
-        {
-            currentBlock = sourceDirEntry->first_blk;
-        }
+        std::cerr << "Invalid path." << std::endl;
+        return -1;
     }
 
-    // Now, currentBlock is where the source file should be
-    uint8_t source_dir_data[BLOCK_SIZE];
-    disk.read(currentBlock, source_dir_data);
-    struct dir_entry *source_dir_entries = reinterpret_cast<struct dir_entry *>(source_dir_data);
-
-    // Check write permission on the source directory (for delete)
-    if (!(source_dir_entries[0].access_rights & WRITE))
-    { // Assuming the first entry [0] is the directory itself
-        std::cerr << "Write permission denied for source directory.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
+    // Check write permission on the directory containing the file/directory to be removed
+    if (!(dir_rights(currentBlock) & WRITE))
+    {
+        std::cerr << "Write permission denied for directory: " << filepath << "\n";
         return -1;
     }
 
-    int sourceIndex = find_directory_entry(sourcePathParts.back(), source_dir_entries);
-    if (sourceIndex == -1)
+    struct dir_entry target;
+    struct dir_slot targetSlot;
+    if (dir_lookup(currentBlock, targetName, target, &targetSlot) != 0)
     {
-        std::cerr << "Source file not found.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
+        std::cerr << "Entry not found.\n";
         return -1;
     }
 
-    // Find the directory for the destination path
-    currentBlock = (destpath[0] == '/') ? ROOT_BLOCK : current_directory_block;
-    struct dir_entry *destDirEntry = nullptr;
-    std::string destFileName = destPathParts.back(); // Extract the filename from the destination path
-    destPathParts.pop_back();                        // Remove the filename part, leaving only the directory path
-    for (const auto &part : destPathParts)
+    // A whole tree is freed in memory, only the FAT and the directory
+    // holding the target are written, once
+    if (target.type == TYPE_DIR && recursive)
     {
-        current_directory_block = currentBlock; // Update current directory
-        destDirEntry = find_directory_entry(part);
-        if (destDirEntry == nullptr)
-        {
-            std::cerr << "Destination path invalid or directory does not exist.\n";
-            current_directory_block = backupCurrentDirectoryBlock;
+        std::vector<unsigned> dirs, files;
+        if (collect_tree(target.first_blk, dirs, files) != 0)
             return -1;
-        }
-        currentBlock = destDirEntry->first_blk;
+        free_tree(dirs, files);
+        dir_remove(targetSlot);
+        return write_fat();
     }
 
-    // Now, currentBlock is where the destination directory is
-    uint8_t dest_dir_data[BLOCK_SIZE];
-    disk.read(currentBlock, dest_dir_data);
-    struct dir_entry *dest_dir_entries = reinterpret_cast<struct dir_entry *>(dest_dir_data);
-
-    // Check if the destination file already exists
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); i++)
+    // If the target is a directory, ensure it's empty
+    if (target.type == TYPE_DIR)
     {
-        if (strcmp(dest_dir_entries[i].file_name, destFileName.c_str()) == 0)
+        bool empty = true;
+        dir_for_each(target.first_blk, [&empty](const struct dir_entry &entry)
+                     {
+            // skip the "." and ".." entries
+            if (strcmp(entry.file_name, ".") != 0 && strcmp(entry.file_name, "..") != 0)
+                empty = false;
+            return empty; });
+        if (!empty)
+        {
+            std::cerr << "Error: Directory is not empty.\n";
+            return -1;
+        }
+        if (target.first_blk == current_directory_block)
         {
-            std::cerr << "Destination file already exists: " << destFileName << std::endl;
-            current_directory_block = backupCurrentDirectoryBlock;
-            return -1; // File already exists
+            std::cerr << "Error: Directory is the current directory.\n";
+            return -1;
         }
+        dir_forget(target.first_blk);
     }
 
-    // Check write permission on the destination directory (for add)
-    if (!(dest_dir_entries[0].access_rights & WRITE))
-    { // Assuming the first entry [0] is the directory itself
-        std::cerr << "Write permission denied for destination directory.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
-        return -1;
-    }
+    // Mark its blocks as free in the FAT, a directory may span several.
+    // An inline file has none, its data goes with the entry.
+    if (!is_inline(target))
+        free_chain(target.first_blk);
+    write_fat();
 
-    int destIndex = find_free_directory_entry(dest_dir_entries);
-    if (destIndex == -1 && destPathParts.size() != 0)
-    { // If we're moving (not just renaming in the same directory)
-        std::cerr << "Destination directory is full. Cannot move file.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
+    // Remove its directory entry
+    dir_remove(targetSlot);
+    return 0;
+}
+
+// append <filepath1> <filepath2> appends the contents of file <filepath1> to
+// the end of file <filepath2>. The file <filepath1> is unchanged.
+int FS::append(const std::string &filepath1, const std::string &filepath2)
+{
+    std::cout << "FS::append(" << filepath1 << ", " << filepath2 << ")\n";
+    CommandScope scope(this, "append");
+
+    // Open the source for reading and the destination for writing, at its end
+    int source = open(filepath1, READ);
+    if (source < 0)
+        return -1;
+    int dest = open(filepath2, WRITE);
+    if (dest < 0 || seek(dest, 0, SEEK_END) < 0)
+    {
+        close(source);
+        if (dest >= 0)
+            close(dest);
         return -1;
     }
 
-    if (destPathParts.size() == 0)
-    { // Renaming in the same directory
-        strncpy(source_dir_entries[sourceIndex].file_name, destFileName.c_str(), sizeof(source_dir_entries[sourceIndex].file_name) - 1);
-        source_dir_entries[sourceIndex].file_name[sizeof(source_dir_entries[sourceIndex].file_name) - 1] = '\0'; // Ensure null-termination
-        // Write back the modified directory entry to the disk
-        disk.write(backupCurrentDirectoryBlock, source_dir_data); // Write back to the source directory
-    }
-    else
-    {                                                                  // Moving to a different directory
-        dest_dir_entries[destIndex] = source_dir_entries[sourceIndex]; // Copy the entry
-        strncpy(dest_dir_entries[destIndex].file_name, destFileName.c_str(), sizeof(dest_dir_entries[destIndex].file_name) - 1);
-        dest_dir_entries[destIndex].file_name[sizeof(dest_dir_entries[destIndex].file_name) - 1] = '\0'; // Ensure null-termination
-        source_dir_entries[sourceIndex].file_name[0] = '\0';                                             // Mark the source entry as deleted
-        // Write back the modified directory entries to the disk
-        disk.write(currentBlock, dest_dir_data);                  // Destination directory
-        disk.write(backupCurrentDirectoryBlock, source_dir_data); // Source directory
-    }
+    // Stream only the source as it is now, it may be the destination as well
+    int ret = stream(source, dest, handles[source].entry.size);
+    close(source);
+    close(dest);
+    if (ret != 0)
+        return -1;
 
-    // Update FAT if needed (not covered here, depends on your specific implementation)
+    std::cout << "Completed appending " << filepath1 << " to " << filepath2 << ".\n";
 
-    current_directory_block = backupCurrentDirectoryBlock; // Restore original current directory
     return 0;
 }
 
-// rm <filepath> removes / deletes the file <filepath>
-int FS::rm(std::string filepath)
+// import <hostpath> <fspath> copies the host file <hostpath> into a new
+// file. Its blocks are reserved at once and filled in the kernel with
+// copy_file_range if the device is a file, through memory otherwise.
+int FS::import_file(const std::string &hostpath, const std::string &fspath, bool recursive)
 {
-    std::cout << "FS::rm()\n";
-
-    // 1. Resolve paths to their components
-    std::vector<std::string> pathParts = resolve_path(filepath);
-    if (pathParts.empty())
+    std::cout << "FS::import(" << hostpath << ", " << fspath << ")\n";
+    CommandScope scope(this, "import");
+    if (recursive)
+        return import_tree(hostpath, fspath);
+    auto start = std::chrono::steady_clock::now();
+
+    int fd = ::open(hostpath.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        std::cerr << "Can't read host file: " << hostpath << "\n";
+        if (fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+    if ((uint64_t)st.st_size > UINT32_MAX)
     {
-        std::cerr << "Invalid path." << std::endl;
+        std::cerr << "Host file too large: " << hostpath << "\n";
+        ::close(fd);
         return -1;
     }
 
-    // Backup the current directory block for restoration later
-    unsigned int backupCurrentDirectoryBlock = current_directory_block;
+    // Like cp, a directory as destination gets the file under its host name
+    unsigned dir_block;
+    std::string_view name;
+    std::string_view host_name = hostpath;
+    host_name.remove_prefix(host_name.rfind('/') + 1);
+    struct dir_entry existing;
+    int ret = -1;
+    if (walk_path(fspath, dir_block, name) != 0)
+        goto out;
+    if (name.empty())
+        name = host_name;
+    else if (dir_lookup(dir_block, name, existing) == 0 && existing.type == TYPE_DIR)
+    {
+        dir_block = existing.first_blk;
+        name = host_name;
+    }
+    if (!name_fits(name))
+        goto out;
+    if (!(dir_rights(dir_block) & WRITE))
+    {
+        std::cerr << "Write permission denied for directory: " << fspath << "\n";
+        goto out;
+    }
+    if (dir_lookup(dir_block, name, existing) == 0)
+    {
+        std::cerr << "File already exists: " << name << std::endl;
+        goto out;
+    }
+
+    bool in_kernel;
+    ret = import_data(fd, st.st_size, dir_block, name, in_kernel);
+    write_fat();
+    if (ret == 0)
+        print_transfer("Imported", st.st_size, start,
+                       in_kernel ? "copy_file_range" : fits_inline(st.st_size) ? "inline" : "read/write");
+out:
+    ::close(fd);
+    return ret;
+}
 
-    // Find the directory of the file/directory to be removed
-    unsigned int currentBlock = current_directory_block;
-    struct dir_entry *dirEntry = nullptr;
-    for (size_t i = 0; i < pathParts.size() - 1; ++i)
+// a file or directory of a host tree to import. The children of a
+// directory come one after the other.
+struct host_node {
+    std::string path;
+    std::string name;
+    uint64_t size;
+    bool dir;
+    size_t first_child, children;
+    unsigned dir_block, parent_block; // of the directory made for it
+};
+
+// plan_tree lists the host directory root and everything below it,
+// breadth first and in name order. Anything but files and directories,
+// symbolic links too, is skipped.
+static int plan_tree(const std::string &root, std::vector<struct host_node> &nodes, unsigned &skipped)
+{
+    nodes.push_back({root, "", 0, true, 0, 0, 0, 0});
+    for (size_t i = 0; i < nodes.size(); ++i)
     {
-        current_directory_block = currentBlock; // Update current directory
-        dirEntry = find_directory_entry(pathParts[i]);
-        if (dirEntry == nullptr || dirEntry->type != TYPE_DIR)
+        if (!nodes[i].dir)
+            continue;
+        DIR *dir = opendir(nodes[i].path.c_str());
+        if (dir == nullptr)
         {
-            std::cerr << "Directory not found: " << pathParts[i] << "\n";
-            current_directory_block = backupCurrentDirectoryBlock;
+            std::cerr << "Can't read host directory: " << nodes[i].path << "\n";
             return -1;
         }
-        currentBlock = dirEntry->first_blk; // Move to the next directory in the path
+        std::vector<struct host_node> children;
+        while (struct dirent *d = readdir(dir))
+        {
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+            struct stat st;
+            if (fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+            {
+                skipped++;
+                continue;
+            }
+            children.push_back({nodes[i].path + "/" + d->d_name, d->d_name,
+                                S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0, S_ISDIR(st.st_mode), 0, 0, 0, 0});
+        }
+        closedir(dir);
+        std::sort(children.begin(), children.end(), [](const struct host_node &a, const struct host_node &b)
+                  { return a.name < b.name; });
+        nodes[i].first_child = nodes.size();
+        nodes[i].children = children.size();
+        for (struct host_node &child : children)
+            nodes.push_back(std::move(child));
     }
+    return 0;
+}
 
-    // Now, currentBlock is where the file/directory to be removed should be
-    uint8_t dir_data[BLOCK_SIZE];
-    disk.read(currentBlock, dir_data);
-    struct dir_entry *dir_entries = reinterpret_cast<struct dir_entry *>(dir_data);
+// import_tree copies a host directory tree in one batch. The tree is
+// listed and checked first and the blocks of all its files and
+// directories are reserved at once, in the order they are filled. The
+// entries of a directory are all added before the next directory, and
+// the FAT and the directory blocks are written back once at the end.
+int FS::import_tree(const std::string &hostpath, const std::string &fspath)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::string root = hostpath;
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+    std::vector<struct host_node> nodes;
+    unsigned skipped = 0;
+    if (plan_tree(root, nodes, skipped) != 0)
+        return -1;
 
-    // Check write permission on the directory containing the file/directory to be removed
-    if (!(dir_entries[0].access_rights & WRITE))
-    { // Assuming the first entry [0] is the directory itself
-        std::cerr << "Write permission denied for directory: " << pathParts[pathParts.size() - 2] << "\n";
-        current_directory_block = backupCurrentDirectoryBlock;
+    // Like mkdir, or under the host name in an existing directory
+    unsigned dir_block;
+    std::string_view name;
+    std::string_view host_name = root;
+    host_name.remove_prefix(host_name.rfind('/') + 1);
+    struct dir_entry existing;
+    if (walk_path(fspath, dir_block, name) != 0)
         return -1;
+    if (name.empty())
+        name = host_name;
+    else if (dir_lookup(dir_block, name, existing) == 0 && existing.type == TYPE_DIR)
+    {
+        dir_block = existing.first_blk;
+        name = host_name;
     }
-
-    std::string targetName = pathParts.back(); // The last part is the name of the file/directory to be removed
-    int entryIndex = find_directory_entry(targetName, dir_entries);
-    if (entryIndex == -1)
+    if (!(dir_rights(dir_block) & WRITE))
     {
-        std::cerr << "Entry not found.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
+        std::cerr << "Write permission denied for directory: " << fspath << "\n";
         return -1;
     }
+    if (dir_lookup(dir_block, name, existing) == 0)
+    {
+        std::cerr << "File already exists: " << name << std::endl;
+        return -1;
+    }
+    nodes[0].name = name;
 
-    struct dir_entry target = dir_entries[entryIndex];
-
-    // If the target is a directory, ensure it's empty
-    if (target.type == TYPE_DIR)
+    // Nothing changes unless every name fits and the blocks are there
+    size_t blocks = 0, files = 0;
+    uint64_t bytes = 0;
+    for (const struct host_node &node : nodes)
+    {
+        if (node.name.size() >= sizeof(existing.file_name))
+        {
+            std::cerr << "Name too long: " << node.path << "\n";
+            return -1;
+        }
+        if (node.dir)
+        {
+            blocks++;
+            continue;
+        }
+        if (node.size > UINT32_MAX)
+        {
+            std::cerr << "Host file too large: " << node.path << "\n";
+            return -1;
+        }
+        if (!fits_inline(node.size))
+            blocks += std::max<uint64_t>(1, (node.size + block_size - 1) / block_size);
+        files++;
+        bytes += node.size;
+    }
+    if (blocks > free_map.get_free_blocks())
     {
-        uint8_t dir_data[BLOCK_SIZE];
-        disk.read(target.first_blk, dir_data);
-        struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data);
-        for (int i = 1; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
-        { // Start from 1 to skip ".." entry
-            if (entries[i].file_name[0] != '\0')
+        std::cerr << "No free blocks available, the tree needs " << blocks << ".\n";
+        return -1;
+    }
+    if (allocate_chain(blocks, 0, batch_blocks) != 0)
+        return -1;
+    batch_next = 0;
+    fat_batch = true;
+
+    // A directory gets its first block written when its turn comes, it
+    // would be evicted and read back in between otherwise
+    nodes[0].parent_block = dir_block;
+    int ret = dir_make(dir_block, name, false, nodes[0].dir_block, false);
+    size_t i = 0;
+    for (; ret == 0 && i < nodes.size(); ++i)
+    {
+        const struct host_node &dir = nodes[i];
+        if (!dir.dir)
+            continue;
+        dir_start({dir.dir_block}, dir.parent_block, false);
+        // the files are opened by name in their host directory
+        int host_dir = ::open(dir.path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (host_dir < 0)
+        {
+            std::cerr << "Can't read host directory: " << dir.path << "\n";
+            ret = -1;
+            break;
+        }
+        for (size_t c = dir.first_child; ret == 0 && c < dir.first_child + dir.children; ++c)
+        {
+            struct host_node &node = nodes[c];
+            if (node.dir)
             {
-                std::cerr << "Error: Directory is not empty.\n";
-                current_directory_block = backupCurrentDirectoryBlock;
-                return -1;
+                node.parent_block = dir.dir_block;
+                ret = dir_make(dir.dir_block, node.name, false, node.dir_block, false);
+                continue;
+            }
+            int fd = openat(host_dir, node.name.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                std::cerr << "Can't read host file: " << node.path << "\n";
+                ret = -1;
+                break;
             }
+            bool in_kernel;
+            ret = import_data(fd, node.size, dir.dir_block, node.name, in_kernel);
+            ::close(fd);
         }
-
-        // If directory is empty, mark its block as free in the FAT
-        disk.read(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
-        fat[target.first_blk] = FAT_FREE;
-        disk.write(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
+        ::close(host_dir);
     }
-    // If it's a file, mark its blocks as free in the FAT
-    else
+
+    // what a failed import didn't use goes back, and so does the part of
+    // the tree it made. Directories not started yet are started to be read.
+    if (batch_next < batch_blocks.size())
+        free_chain(batch_blocks[batch_next]);
+    struct dir_slot slot;
+    if (ret != 0 && dir_lookup(dir_block, name, existing, &slot) == 0)
     {
-        int16_t currentBlock = target.first_blk;
-        while (currentBlock != FAT_EOF)
+        for (; i < nodes.size(); ++i)
         {
-            disk.read(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
-            int16_t nextBlock = fat[currentBlock];
-            fat[currentBlock] = FAT_FREE;
-            currentBlock = nextBlock;
-            disk.write(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
+            if (nodes[i].dir && nodes[i].dir_block != ROOT_BLOCK)
+                dir_start({nodes[i].dir_block}, nodes[i].parent_block, false);
+        }
+        std::vector<unsigned> dirs, files;
+        if (collect_tree(nodes[0].dir_block, dirs, files) == 0)
+        {
+            free_tree(dirs, files);
+            dir_remove(slot);
         }
     }
+    batch_blocks.clear();
+    batch_next = 0;
+    fat_batch = false;
+    if (write_fat() != 0 || sync() != 0 || ret != 0)
+        return -1;
 
-    // Remove its directory entry
-    memset(&dir_entries[entryIndex], 0, sizeof(struct dir_entry));
-
-    // Write back the modified directory to the disk
-    disk.write(currentBlock, dir_data); // Write to the actual directory, not just the current directory
-
-    current_directory_block = backupCurrentDirectoryBlock; // Restore original current directory
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    char line[160];
+    snprintf(line, sizeof(line), "Imported %zu files, %zu directories, %llu bytes in %.2f ms, %.0f files/s\n", files,
+             nodes.size() - files, (unsigned long long)bytes, ms, files * 1e3 / std::max(ms, 1e-3));
+    std::cout << line;
+    if (skipped > 0)
+        std::cout << "Skipped " << skipped << " entries that are neither files nor directories.\n";
     return 0;
 }
 
-// append <filepath1> <filepath2> appends the contents of file <filepath1> to
-// the end of file <filepath2>. The file <filepath1> is unchanged.
-int FS::append(std::string filepath1, std::string filepath2)
+// import_data makes a file of the first size bytes of fd in a directory,
+// the caller checked the name and writes the FAT. in_kernel tells if the
+// data went from file to file in the kernel.
+int FS::import_data(int fd, uint32_t size, unsigned dir_block, std::string_view name, bool &in_kernel)
 {
-    std::cout << "FS::append(" << filepath1 << ", " << filepath2 << ")\n";
-
-    // Resolve paths to their components
-    std::vector<std::string> pathParts1 = resolve_path(filepath1);
-    std::vector<std::string> pathParts2 = resolve_path(filepath2);
-
-    if (pathParts1.empty() || pathParts2.empty())
-    {
-        std::cerr << "Invalid path.\n";
-        return -1;
-    }
-
-    // Find the directory entry of the source file
-    unsigned int currentBlock1 = current_directory_block;
-    struct dir_entry *dirEntry1 = nullptr;
-    for (size_t i = 0; i < pathParts1.size() - 1; ++i)
-    {
-        dirEntry1 = find_directory_entry(pathParts1[i]);
-        if (dirEntry1 == nullptr || dirEntry1->type != TYPE_DIR)
+    struct dir_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    set_entry_name(entry, name);
+    entry.size = size;
+    entry.type = TYPE_FILE;
+    entry.access_rights = READ | WRITE; // default rights
+
+    std::vector<uint8_t> data;
+    std::vector<unsigned> blocks;
+    in_kernel = false;
+    if (fits_inline(size))
+    {
+        data.resize(size);
+        if (host_read(fd, data.data(), size, 0) != 0)
         {
-            std::cerr << "Directory not found in source path: " << pathParts1[i] << "\n";
+            std::cerr << "Can't read host file.\n";
             return -1;
         }
-        currentBlock1 = dirEntry1->first_blk;
+        entry.flags = ENTRY_INLINE;
+        entry.first_blk = ROOT_BLOCK;
     }
-
-    // Find the directory entry of the destination file
-    unsigned int currentBlock2 = current_directory_block;
-    struct dir_entry *dirEntry2 = nullptr;
-    for (size_t i = 0; i < pathParts2.size() - 1; ++i)
+    else
     {
-        dirEntry2 = find_directory_entry(pathParts2[i]);
-        if (dirEntry2 == nullptr || dirEntry2->type != TYPE_DIR)
+        if (take_blocks(std::max<size_t>(1, ((size_t)size + block_size - 1) / block_size), 0, blocks) != 0)
+        {
+            std::cerr << "No free blocks available." << std::endl;
+            return -1;
+        }
+        entry.first_blk = blocks[0];
+        if (import_chain(fd, size, blocks, in_kernel) != 0)
         {
-            std::cerr << "Directory not found in destination path: " << pathParts2[i] << "\n";
+            free_chain(blocks[0]);
             return -1;
         }
-        currentBlock2 = dirEntry2->first_blk;
     }
 
-    // Now, currentBlock1 is where the source file should be
-    uint8_t dir_data1[BLOCK_SIZE];
-    disk.read(currentBlock1, dir_data1);
-    struct dir_entry *dir_entries1 = reinterpret_cast<struct dir_entry *>(dir_data1);
-    int fileIndex1 = find_directory_entry(pathParts1.back(), dir_entries1);
-    if (fileIndex1 == -1)
+    if (dir_insert(dir_block, entry, data.data()) != 0)
     {
-        std::cerr << "Source file not found: " << pathParts1.back() << "\n";
+        std::cerr << "Directory full: " << name << std::endl;
+        if (!blocks.empty())
+            free_chain(blocks[0]);
         return -1;
     }
+    return 0;
+}
 
-    dirEntry1 = &dir_entries1[fileIndex1]; // Get the directory entry of the source file
-
-    // Check read permission on the source file
-    if (!(dirEntry1->access_rights & READ))
-    {
-        std::cerr << "Read permission denied for source file: " << pathParts1.back() << "\n";
-        return -1;
-    }
+// import_chain fills blocks with size bytes of fd, a run of adjacent
+// blocks per copy in the kernel where the device can, a batch of blocks
+// per vectored write otherwise. The tail of the last block is left as is
+// in the kernel, nothing reads past the size.
+int FS::import_chain(int fd, uint32_t size, const std::vector<unsigned> &blocks, bool &in_kernel)
+{
+    in_kernel = true;
+    std::vector<uint8_t> buffer;
+    for (size_t i = 0; i < blocks.size();)
+    {
+        size_t run = 1;
+        while (i + run < blocks.size() && blocks[i + run] == blocks[i] + run)
+            run++;
+        uint64_t offset = (uint64_t)i * block_size;
+        uint64_t length = std::min<uint64_t>((uint64_t)run * block_size, size - std::min<uint64_t>(offset, size));
+        // cached copies of the blocks would be stale
+        for (size_t j = 0; j < run; ++j)
+            cache.discard(blocks[i + j]);
+
+        int64_t copied = length == 0 ? 0 : device->copy_in(fd, offset, blocks[i], length);
+        if (copied == (int64_t)length)
+        {
+            i += run;
+            continue;
+        }
+        if (copied > 0)
+        {
+            std::cerr << "Host file changed while importing.\n";
+            return -1;
+        }
 
-    // Now, currentBlock2 is where the destination file should be
-    uint8_t dir_data2[BLOCK_SIZE];
-    disk.read(currentBlock2, dir_data2);
-    struct dir_entry *dir_entries2 = reinterpret_cast<struct dir_entry *>(dir_data2);
-    int fileIndex2 = find_directory_entry(pathParts2.back(), dir_entries2);
-    if (fileIndex2 == -1)
-    {
-        std::cerr << "Destination file not found: " << pathParts2.back() << "\n";
-        return -1;
+        // through memory, the last block is zero padded by write_chain
+        in_kernel = false;
+        size_t batch = std::min<size_t>(run, CHAIN_BATCH_BLOCKS);
+        std::vector<unsigned> batch_blocks(blocks.begin() + i, blocks.begin() + i + batch);
+        length = std::min<uint64_t>((uint64_t)batch * block_size, length);
+        buffer.resize(length);
+        if (host_read(fd, buffer.data(), length, offset) != 0)
+        {
+            std::cerr << "Can't read host file.\n";
+            return -1;
+        }
+        if (write_chain(batch_blocks, buffer.data(), length) != 0)
+            return -1;
+        i += batch;
     }
+    return 0;
+}
 
-    dirEntry2 = &dir_entries2[fileIndex2]; // Get the directory entry of the destination file
+// export <fspath> <hostpath> copies a file to the host. Its data blocks
+// go from the device to the host file in the kernel, a run of adjacent
+// blocks per copy, if the device can, and through a handle otherwise.
+int FS::export_file(const std::string &fspath, const std::string &hostpath)
+{
+    std::cout << "FS::export(" << fspath << ", " << hostpath << ")\n";
+    CommandScope scope(this, "export");
+    auto start = std::chrono::steady_clock::now();
 
-    // Check write permission on the destination file
-    if (!(dirEntry2->access_rights & (READ | WRITE)))
+    int source = open(fspath, READ);
+    if (source < 0)
+        return -1;
+    struct dir_entry entry = handles[source].entry;
+    int fd = ::open(hostpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
-        std::cerr << "Read and write permission denied for destination file: " << pathParts2.back() << "\n";
+        std::cerr << "Can't write host file: " << hostpath << "\n";
+        close(source);
         return -1;
     }
 
-    // Read the FAT
-    disk.read(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
-
-    int16_t currentBlockDest = dirEntry2->first_blk;
-    while (fat[currentBlockDest] != FAT_EOF)
+    // The device is read past the cache, which must be written back first
+    uint64_t offset = 0;
+    bool in_kernel = !is_inline(entry) && cache.sync() == 0;
+    for (int32_t block = entry.first_blk; in_kernel && offset < entry.size;)
     {
-        currentBlockDest = fat[currentBlockDest];
+        unsigned run = 1;
+        while ((uint64_t)run * block_size < entry.size - offset && fat[block + run - 1] == block + (int32_t)run)
+            run++;
+        uint64_t length = std::min<uint64_t>((uint64_t)run * block_size, entry.size - offset);
+        if (device->copy_out(block, length, fd, offset) != (int64_t)length)
+        {
+            in_kernel = false;
+            break;
+        }
+        offset += length;
+        block = fat[block + run - 1];
     }
-    // Find the last block of the destination file and the position to start writing in it
-    uint8_t lastBlockData[BLOCK_SIZE];
-    disk.read(currentBlockDest, lastBlockData);
-    int positionInLastBlock = dirEntry2->size % BLOCK_SIZE;
 
-    // Read the content of the source file
-    int16_t currentBlockSrc = dirEntry1->first_blk;
-    uint8_t block_data[BLOCK_SIZE];
-    int bytesRead = 0;
-    while (currentBlockSrc != FAT_EOF)
+    // the rest through memory, from where the kernel stopped
+    int ret = 0;
+    if (offset < entry.size)
     {
-        disk.read(currentBlockSrc, block_data);
-
-        for (int i = 0; i < BLOCK_SIZE; ++i)
+        std::vector<uint8_t> chunk(std::clamp<size_t>(entry.size - offset, 1, (size_t)CHAIN_BATCH_BLOCKS * block_size));
+        int64_t n = seek(source, offset, SEEK_SET);
+        while (n >= 0 && (n = read(source, chunk.data(), chunk.size())) > 0)
         {
-            // Check if we need a new block for the destination file
-            if (positionInLastBlock == BLOCK_SIZE)
-            {
-                // Find a free block
-                int16_t freeBlockDest = find_free_fat_entry();
-                if (freeBlockDest == -1)
-                {
-                    std::cerr << "No free blocks left on disk.\n";
-                    return -1;
-                }
-
-                // Update FAT for the destination file
-                fat[currentBlockDest] = freeBlockDest;
-                fat[freeBlockDest] = FAT_EOF;
-
-                // Write the current last block to disk
-                disk.write(currentBlockDest, lastBlockData);
-
-                // Reset lastBlockData and positionInLastBlock
-                memset(lastBlockData, 0, BLOCK_SIZE);
-                positionInLastBlock = 0;
-                currentBlockDest = freeBlockDest;
-            }
-
-            // Write byte from source file to destination file
-            lastBlockData[positionInLastBlock] = block_data[i];
-            positionInLastBlock++;
-            dirEntry2->size++;
-
-            // Break if we have read all bytes of the source file
-            if (++bytesRead == dirEntry1->size)
+            if (host_write(fd, chunk.data(), n, offset) != 0)
             {
+                std::cerr << "Can't write host file: " << hostpath << "\n";
+                n = -1;
                 break;
             }
+            offset += n;
         }
-
-        // Go to the next block of the source file
-        currentBlockSrc = fat[currentBlockSrc];
-    }
-
-    // Write the last block of the destination file to disk
-    disk.write(currentBlockDest, lastBlockData);
-
-    // Update the size of the destination file in its directory entry
-    dir_entries2[fileIndex2].size = dirEntry2->size;
-
-    // Write back the updated directory entries and FAT to the disk
-    disk.write(currentBlock2, dir_data2); // Write to the destination directory
-    disk.write(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
-
-    std::cout << "Completed appending " << filepath1 << " to " << filepath2 << ".\n";
-
-    return 0;
+        ret = n < 0 ? -1 : 0;
+    }
+    close(source);
+    if (::close(fd) != 0)
+        ret = -1;
+    if (ret == 0)
+        print_transfer("Exported", entry.size, start,
+                       in_kernel ? "copy_file_range" : is_inline(entry) ? "inline" : "read/write");
+    return ret;
 }
 
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
 // in the current directory
-int FS::mkdir(std::string dirpath)
+int FS::mkdir(const std::string &dirpath, bool btree)
 {
     std::cout << "FS::mkdir()\n";
-
-    // Resolve the path to get the parts
-    std::vector<std::string> parts = resolve_path(dirpath);
-    unsigned parent_block = (dirpath[0] == '/') ? ROOT_BLOCK : current_directory_block;
-
-    std::string dirname = parts.back(); // The last part is the directory to create
-    parts.pop_back();                   // Remove the last part as it's the new directory name
+    CommandScope scope(this, "mkdir");
 
     // Find the block of the parent directory
-    for (const std::string &part : parts)
+    unsigned parent_block;
+    std::string_view dirname; // The last part is the directory to create
+    if (walk_path(dirpath, parent_block, dirname) != 0)
+        return -1;
+    if (dirname.empty())
     {
-        uint8_t dir_data[BLOCK_SIZE];
-        disk.read(parent_block, dir_data);
-        struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data);
-
-        bool found = false;
-        for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
-        {
-            if (entries[i].type == TYPE_DIR && part == entries[i].file_name)
-            {
-                parent_block = entries[i].first_blk;
-                found = true;
-                break;
-            }
-        }
-
-        if (!found)
-        {
-            std::cerr << "Parent directory " << part << " not found.\n";
-            return -1;
-        }
+        std::cerr << "Invalid path.\n";
+        return -1;
     }
+    if (!name_fits(dirname))
+        return -1;
 
-    // Read the parent directory from disk
-    uint8_t parent_dir_data[BLOCK_SIZE];
-    disk.read(parent_block, parent_dir_data);
-    struct dir_entry *parent_dir_entries = reinterpret_cast<struct dir_entry *>(parent_dir_data);
-
+    struct dir_entry entry;
     // Check if the directory name already exists in the parent directory
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    if (dir_lookup(parent_block, dirname, entry) == 0)
     {
-        if (strcmp(parent_dir_entries[i].file_name, dirname.c_str()) == 0)
-        {
-            std::cerr << "Directory already exists.\n";
-            return -1;
-        }
+        std::cerr << "Directory already exists.\n";
+        return -1;
     }
 
     // Check write permission on the parent directory
-    if (!(parent_dir_entries[0].access_rights & WRITE))
-    { // Assuming the first entry [0] is the directory itself
-        std::cerr << "Write permission denied for directory: " << parts[parts.size() - 1] << "\n";
+    if (!(dir_rights(parent_block) & WRITE))
+    {
+        std::cerr << "Write permission denied for directory: " << dirpath << "\n";
         return -1;
     }
 
-    // Find a free block for the new directory
-    int16_t freeBlock = find_free_fat_entry(2); // Start searching from block 2
+    unsigned dir_block;
+    int ret = dir_make(parent_block, dirname, btree, dir_block);
+
+    // Update FAT
+    write_fat();
+
+    return ret;
+}
 
-    if (freeBlock == -1)
+// dir_make adds the empty directory name to a directory, the caller
+// checked the name and writes the FAT. Without start the caller writes
+// its first block with dir_start before it's used.
+int FS::dir_make(unsigned parent_block, std::string_view dirname, bool btree, unsigned &dir_block, bool start)
+{
+    // Find a free block for the new directory, it starts with one bucket.
+    // A B+tree starts with its first block and an empty leaf.
+    std::vector<unsigned> newBlock;
+    if (take_blocks(btree ? 2 : 1, 2, newBlock) != 0) // Start searching from block 2
     {
         std::cerr << "No free blocks left on disk.\n";
         return -1;
     }
+    unsigned freeBlock = newBlock[0];
+    dir_forget(freeBlock); // the block may have held a removed directory
+    if (start)
+        dir_start(newBlock, parent_block, btree);
+
+    // Update the parent directory with the new directory's entry
+    struct dir_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    set_entry_name(entry, dirname);
+    entry.size = sizeof(struct dir_entry); // size of one dir_entry (for "..")
+    entry.first_blk = freeBlock;
+    entry.type = TYPE_DIR;
+    entry.access_rights = READ | WRITE;
+    if (dir_insert(parent_block, entry) != 0)
+    {
+        std::cerr << "Directory full: " << dirname << "\n";
+        free_chain(freeBlock);
+        return -1;
+    }
+    dir_links[freeBlock] = {parent_block, std::string(dirname)};
+    dir_block = freeBlock;
+    return 0;
+}
 
+// dir_start writes the first block of a new directory with its ".."
+// entry, and the empty leaf of a B+tree in its second block
+void FS::dir_start(const std::vector<unsigned> &blocks, unsigned parent_block, bool btree)
+{
     // Write the ".." entry in the new directory block
-    struct dir_entry new_dir[BLOCK_SIZE / sizeof(struct dir_entry)];
+    std::vector<uint8_t> new_dir_data(block_size);
+    struct dir_entry *new_dir = reinterpret_cast<struct dir_entry *>(new_dir_data.data());
     strcpy(new_dir[0].file_name, "..");
     new_dir[0].size = 0;                 // size is 0 for ".."
     new_dir[0].first_blk = parent_block; // ".." should point back to the parent directory
     new_dir[0].type = TYPE_DIR;
     new_dir[0].access_rights = READ | WRITE;
-
-    for (int i = 1; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
-    {
-        new_dir[i].file_name[0] = '\0'; // Setting the first character to null indicates unused
-        new_dir[i].size = 0;
-        new_dir[i].first_blk = -1; // Indicates no block associated
-    }
-
-    disk.write(freeBlock, reinterpret_cast<uint8_t *>(new_dir));
-
-    // Update the parent directory with the new directory's entry
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    if (btree)
     {
-        if (parent_dir_entries[i].file_name[0] == '\0')
-        {
-            strcpy(parent_dir_entries[i].file_name, dirname.c_str());
-            parent_dir_entries[i].size = sizeof(struct dir_entry); // size of one dir_entry (for "..")
-            parent_dir_entries[i].first_blk = freeBlock;
-            parent_dir_entries[i].type = TYPE_DIR;
-            parent_dir_entries[i].access_rights = READ | WRITE;
-            break;
-        }
+        new_dir[0].flags = ENTRY_BTREE;
+        set_node_header(new_dir[1], NODE_ROOT, blocks[1], 0);
+        std::vector<uint8_t> leaf_data(block_size);
+        set_node_header(reinterpret_cast<struct dir_entry *>(leaf_data.data())[0], NODE_LEAF, 0, 0);
+        cache.write(blocks[1], leaf_data.data());
     }
 
-    disk.write(parent_block, parent_dir_data);
-
-    // Update FAT
-    fat[freeBlock] = FAT_EOF;
-    disk.write(FAT_BLOCK, reinterpret_cast<uint8_t *>(fat));
+    // The remaining entries are zeroed, an empty file name indicates unused
 
-    return 0;
+    cache.write(blocks[0], new_dir_data.data());
 }
 
 // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
-int FS::cd(std::string dirpath)
+int FS::cd(const std::string &dirpath)
 {
     std::cout << "FS::cd()\n";
+    CommandScope scope(this, "cd");
 
-    if (dirpath == "/")
-    {
-        current_directory_block = ROOT_BLOCK;
-        return 0;
-    }
+    unsigned block_to_search;
+    if (walk_dir(dirpath, block_to_search) != 0)
+        return -1;
 
-    std::vector<std::string> parts = resolve_path(dirpath);
-    unsigned block_to_search = (dirpath[0] == '/') ? ROOT_BLOCK : current_directory_block;
+    std::cout << "Changing directory to block: " << block_to_search << std::endl;
+    current_directory_block = block_to_search;
+    std::cout << "Current directory block is now: " << current_directory_block << std::endl;
 
-    for (const std::string &part : parts)
-    {
-        uint8_t dir_data[BLOCK_SIZE];
-        disk.read(block_to_search, dir_data);
-        struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data);
+    return 0;
+}
 
-        if (part == "..")
-        {
-            // Log before navigating to parent
-            std::cout << "Attempting to navigate to parent from block: " << block_to_search << std::endl;
-            int dotdot_index = find_directory_entry("..", entries);
-            if (dotdot_index == -1)
-            {
-                std::cerr << "Parent directory entry not found.\n";
-                return -1;
-            }
-            block_to_search = entries[dotdot_index].first_blk;
-            std::cout << "Navigated to parent directory block: " << block_to_search << std::endl;
-            continue;
-        }
+// get_dir_link returns the parent and name of a directory. The first
+// time it reads ".." and looks for the directory in its parent.
+const struct dir_link *FS::get_dir_link(unsigned dir_block)
+{
+    auto cached = dir_links.find(dir_block);
+    if (cached != dir_links.end())
+        return &cached->second;
+
+    struct dir_entry parent;
+    if (dir_lookup(dir_block, "..", parent) != 0)
+        return nullptr;
+
+    const struct dir_link *link = nullptr;
+    dir_for_each(parent.first_blk, [&](const struct dir_entry &entry)
+                 {
+        if (entry.first_blk == dir_block && entry.type == TYPE_DIR && strcmp(entry.file_name, "..") != 0)
+            link = &(dir_links[dir_block] = {parent.first_blk, entry.file_name});
+        return link == nullptr; });
+    return link;
+}
 
-        bool found = false;
-        for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+// dir_path builds the absolute path of a directory from the links up to
+// the root, without reading blocks once the links are cached
+int FS::dir_path(unsigned dir_block, std::string &path)
+{
+    path_parts.clear();
+    for (unsigned block = dir_block; block != ROOT_BLOCK;)
+    {
+        const struct dir_link *link = get_dir_link(block);
+        // a directory deeper than the disk has blocks is a loop
+        if (link == nullptr || path_parts.size() >= fat.size())
         {
-            if (entries[i].type == TYPE_DIR && part == entries[i].file_name)
-            {
-                block_to_search = entries[i].first_blk;
-                found = true;
-                break;
-            }
+            std::cerr << "Error: Directory name not found.\n";
+            return -1;
         }
+        path_parts.push_back(&link->name);
+        block = link->parent;
+    }
+
+    path = "/";
+    for (auto part = path_parts.rbegin(); part != path_parts.rend(); ++part)
+    {
+        path += **part;
+        path += '/';
+    }
+    if (path.length() > 1)
+        path.pop_back(); // no slash after the last name
+    return 0;
+}
+
+// pwd prints the full path, i.e., from the root directory, to the current
+// directory, including the currect directory name
+int FS::pwd()
+{
+    std::cout << "FS::pwd()\n";
+    CommandScope scope(this, "pwd");
+    std::cout << "Building path from block: " << current_directory_block << std::endl;
+
+    std::string path;
+    if (dir_path(current_directory_block, path) != 0)
+        return -1;
+    std::cout << path << std::endl;
+    return 0;
+}
 
-        if (!found)
+// find <path> <pattern> prints the paths of everything below <path>
+// whose name matches the shell pattern <pattern>, in name order
+int FS::find(const std::string &path, const std::string &pattern)
+{
+    std::cout << "FS::find()\n";
+    CommandScope scope(this, "find");
+
+    unsigned dir_block;
+    std::string dir;
+    if (walk_dir(path, dir_block) != 0 || dir_path(dir_block, dir) != 0)
+        return -1;
+
+    std::vector<std::vector<std::string>> found(walk_threads);
+    int ret = walk_tree(dir_block, dir, [&](unsigned worker, const std::string &parent, const struct dir_entry &entry)
+                        {
+        if (fnmatch(pattern.c_str(), entry.file_name, 0) == 0)
+            found[worker].push_back((parent == "/" ? "/" : parent + "/") + entry.file_name); });
+    if (ret != 0)
+        return -1;
+
+    // the workers find them in no particular order
+    std::vector<std::string> paths;
+    for (auto &part : found)
+        paths.insert(paths.end(), part.begin(), part.end());
+    std::sort(paths.begin(), paths.end());
+    for (const std::string &p : paths)
+        std::cout << p << "\n";
+    return 0;
+}
+
+// du <path> prints the files, directories, bytes and blocks below <path>.
+// Blocks are counted on the FAT chains, inline files have none.
+int FS::du(const std::string &path)
+{
+    std::cout << "FS::du()\n";
+    CommandScope scope(this, "du");
+
+    unsigned dir_block;
+    std::string dir;
+    if (walk_dir(path, dir_block) != 0 || dir_path(dir_block, dir) != 0)
+        return -1;
+
+    struct usage {
+        uint64_t files = 0, dirs = 0, bytes = 0, blocks = 0;
+    };
+    std::vector<struct usage> used(walk_threads);
+    int ret = walk_tree(dir_block, dir, [&](unsigned worker, const std::string &, const struct dir_entry &entry)
+                        {
+        struct usage &u = used[worker];
+        if (entry.type == TYPE_DIR)
+            u.dirs++;
+        else
         {
-            std::cerr << "Directory " << part << " not found.\n";
-            return -1;
+            u.files++;
+            u.bytes += entry.size;
         }
+        if (!is_inline(entry))
+            u.blocks += chain_blocks(entry.first_blk); });
+    if (ret != 0)
+        return -1;
+
+    struct usage total;
+    total.blocks = chain_blocks(dir_block);
+    for (const struct usage &u : used)
+    {
+        total.files += u.files;
+        total.dirs += u.dirs;
+        total.bytes += u.bytes;
+        total.blocks += u.blocks;
     }
+    std::cout << dir << ": " << total.files << " files, " << total.dirs << " directories, "
+              << total.bytes << " bytes, " << total.blocks << " blocks ("
+              << total.blocks * block_size / 1024 << " KiB)\n";
+    return 0;
+}
 
-    std::cout << "Changing directory to block: " << block_to_search << std::endl;
-    current_directory_block = block_to_search;
-    std::cout << "Current directory block is now: " << current_directory_block << std::endl;
+// chmod <accessrights> <filepath> changes the access rights for the
+// file <filepath> to <accessrights>.
+int FS::chmod(const std::string &accessrights, const std::string &filepath)
+{
+    std::cout << "FS::chmod(" << accessrights << "," << filepath << ")\n";
+    CommandScope scope(this, "chmod");
+
+    // 1. Convert accessrights from string to integer
+    uint8_t newAccessRights;
+    try
+    {
+        newAccessRights = static_cast<uint8_t>(std::stoi(accessrights, nullptr, 8)); // Converting octal string to integer
+    }
+    catch (std::invalid_argument &e)
+    {
+        std::cerr << "Invalid access rights format.\n";
+        return -1;
+    }
+
+    // 2. Find the directory of the file/directory to change permissions
+    unsigned currentBlock;
+    std::string_view targetName; // The last part is the name of the file/directory to change permissions
+    if (walk_path(filepath, currentBlock, targetName) != 0)
+        return -1;
+    struct dir_entry target;
+    struct dir_slot targetSlot;
+    if (dir_lookup(currentBlock, targetName, target, &targetSlot) != 0)
+    {
+        std::cerr << "Entry not found.\n";
+        return -1;
+    }
+
+    // 3. Change the access rights
+    target.access_rights = newAccessRights;
+
+    // 4. Write back the modified directory entry to the disk
+    dir_update(targetSlot, target);
+    return 0;
+}
+
+// sync makes everything written so far durable on the disk
+int FS::sync()
+{
+    CommandScope scope(this, "sync");
+    if (cache.sync() != 0)
+        return -1;
+    return device->sync();
+}
+
+// cachestat prints the block cache counters
+int FS::cachestat()
+{
+    std::cout << "FS::cachestat()\n";
+    uint64_t hits = cache.get_hits();
+    uint64_t misses = cache.get_misses();
+    std::cout << "capacity:   " << cache.get_capacity() << " blocks\n";
+    std::cout << "hits:       " << hits << "\n";
+    std::cout << "misses:     " << misses << "\n";
+    std::cout << "evictions:  " << cache.get_evictions() << "\n";
+    std::cout << "writebacks: " << cache.get_writebacks() << "\n";
+    if (hits + misses > 0)
+        std::cout << "hit ratio:  " << (100 * hits) / (hits + misses) << "%\n";
+    uint64_t io_calls = device->get_io_calls();
+    uint64_t io_blocks = device->get_io_blocks();
+    std::cout << "disk I/O:   " << io_calls << " calls for " << io_blocks << " blocks, "
+              << io_blocks - std::min(io_calls, io_blocks) << " calls saved by coalescing\n";
+    std::cout << "dentries:   " << dentry_count << " cached, " << dentry_hits << " hits, "
+              << dentry_misses << " misses\n";
+    return 0;
+}
+
+FS::CommandScope::CommandScope(FS *fs, const char *name) : fs(fs)
+{
+    if (fs->in_command)
+        return;
+    fs->in_command = true;
+    stats = &fs->commands[name];
+    reads = fs->cache.get_reads();
+    writes = fs->cache.get_writes();
+    disk_reads = fs->device->get_block_reads();
+    disk_writes = fs->device->get_block_writes();
+    start = std::chrono::steady_clock::now();
+}
+
+FS::CommandScope::~CommandScope()
+{
+    if (stats == nullptr)
+        return;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    stats->calls++;
+    stats->reads += fs->cache.get_reads() - reads;
+    stats->writes += fs->cache.get_writes() - writes;
+    stats->disk_reads += fs->device->get_block_reads() - disk_reads;
+    stats->disk_writes += fs->device->get_block_writes() - disk_writes;
+    stats->latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    fs->in_command = false;
+}
 
+// stats prints the device counters and, per command, the blocks it
+// read and wrote and a latency histogram
+int FS::stats()
+{
+    std::cout << "FS::stats()\n";
+    std::cout << "device: " << device->get_block_reads() << " block reads (" << device->get_bytes_read() << " bytes), "
+              << device->get_block_writes() << " block writes (" << device->get_bytes_written() << " bytes), "
+              << device->get_flushes() << " flushes\n";
+    char line[200];
+    snprintf(line, sizeof(line), "%-8s %7s %8s %8s %10s %11s %9s %9s %9s %9s\n", "command", "calls", "reads", "writes",
+           "disk reads", "disk writes", "mean", "p50", "p99", "max");
+    std::cout << line;
+    for (auto &entry : commands)
+    {
+        command_stats &c = entry.second;
+        snprintf(line, sizeof(line), "%-8s %7llu %8llu %8llu %10llu %11llu %9s %9s %9s %9s\n", entry.first.c_str(),
+               (unsigned long long)c.calls, (unsigned long long)c.reads, (unsigned long long)c.writes,
+               (unsigned long long)c.disk_reads, (unsigned long long)c.disk_writes,
+               format_ns(c.latency.mean_ns()).c_str(), ("<" + format_ns(c.latency.percentile_ns(0.5))).c_str(),
+               ("<" + format_ns(c.latency.percentile_ns(0.99))).c_str(), format_ns(c.latency.get_max_ns()).c_str());
+        std::cout << line;
+    }
+    // one histogram line per command
+    for (auto &entry : commands)
+    {
+        std::cout << "  " << entry.first << ":";
+        entry.second.latency.print(std::cout);
+    }
     return 0;
 }
 
-std::string FS::get_directory_name(unsigned block_no)
+// stats reset clears the stats and the cache counters
+int FS::stats_reset()
 {
-    uint8_t dir_data[BLOCK_SIZE];
-    disk.read(block_no, dir_data);
-    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data);
+    std::cout << "FS::stats_reset()\n";
+    commands.clear();
+    device->reset_io_stats();
+    cache.reset_stats();
+    dentry_hits = dentry_misses = 0;
+    return 0;
+}
 
-    unsigned parent_block = entries[0].first_blk; // ".." points to the parent directory
+// find_directory_entry finds a name in one directory block, the scan
+// kernel compares name prefixes DIRSCAN_BATCH entries at a time
+int FS::find_directory_entry(std::string_view name, dir_entry *entries)
+{
+    if (name.empty() || name.size() >= sizeof(entries[0].file_name))
+        return -1; // Not found
+    struct dirscan_key key;
+    dirscan_make_key(name, key);
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(entries);
+    for (unsigned base = 0; base < entries_per_block; base += DIRSCAN_BATCH)
+    {
+        unsigned count = std::min(entries_per_block - base, (unsigned)DIRSCAN_BATCH);
+        uint64_t hits = dirscan_match(data + base * DIRSCAN_ENTRY_SIZE, count, key);
+        for (; hits != 0; hits &= hits - 1)
+        {
+            unsigned i = base + __builtin_ctzll(hits);
+            // only the prefix of longer names was compared
+            if (name.size() < DIRSCAN_PREFIX || entries[i].file_name == name)
+                return i;
+        }
+    }
+    return -1; // Not found
+}
 
-    uint8_t parent_dir_data[BLOCK_SIZE];
-    disk.read(parent_block, parent_dir_data);
-    struct dir_entry *parent_entries = reinterpret_cast<struct dir_entry *>(parent_dir_data);
+int FS::find_free_directory_entry(dir_entry *entries, unsigned count)
+{
+    // small batches, the first free entry is usually near the start
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(entries);
+    if (count == 1)
+    {
+        for (unsigned base = 0; base < entries_per_block; base += DIRSCAN_FREE_BATCH)
+        {
+            // Unused entries have an empty filename
+            unsigned n = std::min(entries_per_block - base, (unsigned)DIRSCAN_FREE_BATCH);
+            uint64_t unused = ~dirscan_used(data + base * DIRSCAN_ENTRY_SIZE, n) & ((1ULL << n) - 1);
+            if (unused != 0)
+                return base + __builtin_ctzll(unused);
+        }
+        return -1; // No free entries
+    }
 
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    // count free entries in a row, for an inline file
+    unsigned run = 0;
+    for (unsigned base = 0; base < entries_per_block; base += DIRSCAN_BATCH)
     {
-        if (parent_entries[i].first_blk == block_no)
+        unsigned n = std::min(entries_per_block - base, (unsigned)DIRSCAN_BATCH);
+        uint64_t used = dirscan_used(data + base * DIRSCAN_ENTRY_SIZE, n);
+        for (unsigned i = 0; i < n; ++i)
         {
-            return std::string(parent_entries[i].file_name);
+            run = (used >> i) & 1 ? 0 : run + 1;
+            if (run == count)
+                return base + i + 1 - count;
         }
     }
-    return "";
+    return -1;
 }
 
-std::string FS::recursive_pwd(unsigned block_no)
+// dir_compact moves the entries of a block to the front, in order, so its
+// free entries are in one run. Used entries at the start don't move.
+void FS::dir_compact(struct dir_entry *entries)
 {
-    if (block_no == ROOT_BLOCK)
+    unsigned used = 0;
+    for (unsigned i = 0; i < entries_per_block; ++i)
     {
-        return "/";
+        if (entries[i].file_name[0] == '\0')
+            continue;
+        if (i != used)
+            entries[used] = entries[i];
+        used++;
     }
+    memset(entries + used, 0, (entries_per_block - used) * sizeof(struct dir_entry));
+}
 
-    uint8_t dir_data[BLOCK_SIZE];
-    disk.read(block_no, dir_data);
-    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data);
+// fits_inline tells if a file of size bytes is kept inline. The entry and
+// its data stay under a quarter of a block, so either half of a split
+// B+tree leaf has room for one more.
+bool FS::fits_inline(uint32_t size)
+{
+    unsigned run = (entries_per_block - 1) / 4;
+    if (inline_limit == 0 || run == 0)
+        return false;
+    size_t max = std::min(run - 1, (unsigned)INLINE_MAX_SLOTS) * INLINE_SLOT_DATA;
+    return size <= std::min(max, inline_limit);
+}
 
-    // Assuming ".." is always the first entry which points to the parent directory
-    unsigned parent_block = entries[0].first_blk;
+// read_inline copies the data of an inline file out of its directory block
+int FS::read_inline(const struct dir_slot &slot, uint32_t size, std::vector<uint8_t> &data)
+{
+    const uint8_t *block = cache.get(slot.block_no);
+    std::vector<uint8_t> dir_data;
+    if (block == nullptr)
+    {
+        dir_data.resize(block_size);
+        if (cache.read(slot.block_no, dir_data.data()) != 0)
+            return -1;
+        block = dir_data.data();
+    }
+    data.resize(size);
+    const uint8_t *slot_data = block + (slot.index + 1) * sizeof(struct dir_entry);
+    for (uint32_t off = 0; off < size; off += INLINE_SLOT_DATA, slot_data += sizeof(struct dir_entry))
+        memcpy(data.data() + off, slot_data + 1, std::min<uint32_t>(INLINE_SLOT_DATA, size - off));
+    return 0;
+}
 
-    std::string current_directory_name = get_directory_name(block_no);
-    if (current_directory_name.empty())
+// open returns a descriptor for the file <filepath>, for reading and / or
+// writing as its access rights allow
+int FS::open(const std::string &filepath, uint8_t mode)
+{
+    unsigned dir_block;
+    std::string_view name;
+    if (walk_path(filepath, dir_block, name) != 0)
+        return -1;
+    struct dir_entry entry;
+    struct dir_slot slot;
+    if (name.empty() || dir_lookup(dir_block, name, entry, &slot) != 0)
     {
-        std::cerr << "Error: Directory name not found.\n";
-        return "";
+        std::cerr << "File not found: " << name << "\n";
+        return -1;
+    }
+    if (entry.type != TYPE_FILE)
+    {
+        std::cerr << name << " is a directory.\n";
+        return -1;
+    }
+    if ((mode & READ) && !(entry.access_rights & READ))
+    {
+        std::cerr << "Read permission denied for file: " << name << "\n";
+        return -1;
+    }
+    if ((mode & WRITE) && !(entry.access_rights & WRITE))
+    {
+        std::cerr << "Write permission denied for file: " << name << "\n";
+        return -1;
+    }
+    return new_handle(entry, slot, mode);
+}
+
+// open_new adds an empty file to a directory, the caller checked that the
+// name is new, and opens it for writing whatever its rights
+int FS::open_new(unsigned dir_block, std::string_view name, uint8_t access_rights)
+{
+    struct dir_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    set_entry_name(entry, name);
+    entry.type = TYPE_FILE;
+    entry.access_rights = access_rights;
+
+    // inline until it grows, an empty file has one block otherwise
+    std::vector<unsigned> blocks;
+    if (fits_inline(0))
+    {
+        entry.flags = ENTRY_INLINE;
+        entry.first_blk = ROOT_BLOCK;
+    }
+    else
+    {
+        if (allocate_chain(1, 0, blocks) != 0)
+        {
+            std::cerr << "No free blocks available." << std::endl;
+            return -1;
+        }
+        entry.first_blk = blocks[0];
+        write_chain(blocks, nullptr, 0);
     }
 
-    return recursive_pwd(parent_block) + current_directory_name + "/";
+    struct dir_slot slot;
+    if (dir_insert(dir_block, entry, nullptr, &slot) != 0)
+    {
+        std::cerr << "Directory full: " << name << std::endl;
+        if (!blocks.empty())
+            free_chain(blocks[0]);
+        write_fat();
+        return -1;
+    }
+    write_fat();
+    return new_handle(entry, slot, WRITE);
 }
 
-// pwd prints the full path, i.e., from the root directory, to the current
-// directory, including the currect directory name
-int FS::pwd()
+int FS::new_handle(const struct dir_entry &entry, const struct dir_slot &slot, uint8_t mode)
 {
-    std::cout << "FS::pwd()\n";
-    std::cout << "Building path from block: " << current_directory_block << std::endl;
+    size_t fd = 0;
+    while (fd < handles.size() && handles[fd].used)
+        fd++;
+    if (fd == handles.size())
+        handles.emplace_back();
+    handles[fd] = {true, mode, entry, slot, dir_version, 0, FAT_EOF, 0, FAT_EOF, 0};
+    auto tail = tails.find(entry.first_blk);
+    if (tail != tails.end() && !is_inline(entry))
+    {
+        handles[fd].last_block = tail->second.block;
+        handles[fd].owned = tail->second.owned;
+    }
+    return fd;
+}
 
-    // If we're in the root directory
-    if (current_directory_block == ROOT_BLOCK)
+struct open_file *FS::get_handle(int fd)
+{
+    if (fd < 0 || (size_t)fd >= handles.size() || !handles[fd].used)
     {
-        std::cout << "/\n";
-        return 0;
+        std::cerr << "Bad file descriptor: " << fd << "\n";
+        return nullptr;
     }
+    return &handles[fd];
+}
 
-    std::string path = recursive_pwd(current_directory_block);
-    if (path.back() == '/' && path.length() > 1)
-    {                    // Check if the last character is a slash and it's not the root directory
-        path.pop_back(); // Remove the last character
+// handle_entry reloads the entry of an open file once any directory has
+// changed, so the handle sees what other handles and commands did to it.
+// A split or a compaction may have moved the entry, then it is looked up
+// by name again.
+int FS::handle_entry(struct open_file &h)
+{
+    if (h.dir_version == dir_version)
+        return 0; // no directory changed since
+    const uint8_t *data = cache.get(h.slot.block_no);
+    std::vector<uint8_t> dir_data;
+    if (data == nullptr)
+    {
+        dir_data.resize(block_size);
+        if (cache.read(h.slot.block_no, dir_data.data()) != 0)
+            return -1;
+        data = dir_data.data();
     }
-    std::cout << path << std::endl;
+    struct dir_entry entry = reinterpret_cast<const struct dir_entry *>(data)[h.slot.index];
+    if (strcmp(entry.file_name, h.entry.file_name) != 0 &&
+        dir_lookup(h.slot.dir_block, h.entry.file_name, entry, &h.slot) != 0)
+    {
+        std::cerr << "File no longer exists: " << h.entry.file_name << "\n";
+        return -1;
+    }
+    // the chain was replaced, e.g. an inline file got data blocks
+    if (entry.first_blk != h.entry.first_blk || is_inline(entry) != is_inline(h.entry))
+        h.block = h.last_block = FAT_EOF;
+    h.entry = entry;
+    h.dir_version = dir_version;
     return 0;
 }
 
-// chmod <accessrights> <filepath> changes the access rights for the
-// file <filepath> to <accessrights>.
-int FS::chmod(std::string accessrights, std::string filepath)
+// handle_seek_block moves the cached block to the one holding the cursor,
+// forward from where it is, or from the start if the cursor went back.
+// A cursor at the end of a full last block stays on that block.
+void FS::handle_seek_block(struct open_file &h)
 {
-    std::cout << "FS::chmod(" << accessrights << "," << filepath << ")\n";
+    // the last block may be known, then an append doesn't walk there
+    uint32_t last_start = (std::max<uint32_t>(1, (h.entry.size + block_size - 1) / block_size) - 1) * block_size;
+    auto tail = h.offset >= last_start ? tails.find(h.entry.first_blk) : tails.end();
+    if (tail != tails.end() && !is_inline(h.entry))
+    {
+        h.block = tail->second.block;
+        h.block_start = last_start;
+    }
+    else if (h.block == FAT_EOF || h.offset < h.block_start)
+    {
+        h.block = h.entry.first_blk;
+        h.block_start = 0;
+    }
+    while (h.offset - h.block_start >= block_size && fat[h.block] != FAT_EOF && fat[h.block] != FAT_FREE)
+    {
+        h.block = fat[h.block];
+        h.block_start += block_size;
+    }
+}
 
-    // 1. Convert accessrights from string to integer
-    uint8_t newAccessRights;
-    try
+int64_t FS::read(int fd, uint8_t *buf, size_t count)
+{
+    struct open_file *h = get_handle(fd);
+    if (h == nullptr || handle_entry(*h) != 0)
+        return -1;
+    if (!(h->mode & READ))
     {
-        newAccessRights = static_cast<uint8_t>(std::stoi(accessrights, nullptr, 8)); // Converting octal string to integer
+        std::cerr << "File not open for reading: " << h->entry.file_name << "\n";
+        return -1;
     }
-    catch (std::invalid_argument &e)
+    if (h->offset >= h->entry.size)
+        return 0;
+    count = std::min<size_t>(count, h->entry.size - h->offset);
+
+    if (is_inline(h->entry))
     {
-        std::cerr << "Invalid access rights format.\n";
+        std::vector<uint8_t> data;
+        if (read_inline(h->slot, h->entry.size, data) != 0)
+            return -1;
+        memcpy(buf, data.data() + h->offset, count);
+        h->offset += count;
+        return count;
+    }
+
+    std::vector<unsigned> batch;
+    std::vector<uint8_t *> blks;
+    std::vector<uint8_t> bounce;
+    size_t done = 0;
+    while (done < count)
+    {
+        handle_seek_block(*h);
+        uint32_t in_block = h->offset - h->block_start;
+        size_t left = count - done;
+        if (in_block == 0 && left >= block_size)
+        {
+            // whole blocks go straight into buf, with one vectored read,
+            // a part of a block at the end goes through bounce in the
+            // same read. The cached block stays on the last of them.
+            batch.clear();
+            blks.clear();
+            size_t n = 0;
+            for (int32_t block = h->block;; block = fat[block])
+            {
+                batch.push_back(block);
+                if (left - n >= block_size)
+                    blks.push_back(buf + done + n);
+                else
+                {
+                    bounce.resize(block_size);
+                    blks.push_back(bounce.data());
+                }
+                n += std::min<size_t>(left - n, block_size);
+                if (fat[block] == FAT_EOF || n == left || batch.size() == CHAIN_BATCH_BLOCKS)
+                    break;
+            }
+            if (cache.readv(batch, blks) != 0)
+                return -1;
+            if (n % block_size != 0)
+                memcpy(buf + done + n - n % block_size, bounce.data(), n % block_size);
+            h->block = batch.back();
+            h->block_start += (batch.size() - 1) * block_size;
+            done += n;
+            h->offset += n;
+            continue;
+        }
+
+        // part of a block, in place when the disk is mapped, as a batch of
+        // one otherwise
+        const uint8_t *data = nullptr;
+        if (device->block_ptr(h->block) != nullptr)
+        {
+            data = cache.get(h->block);
+            if (data == nullptr)
+                data = device->block_ptr(h->block);
+        }
+        else
+        {
+            bounce.resize(block_size);
+            blks.assign(1, bounce.data());
+            if (cache.readv({(unsigned)h->block}, blks) != 0)
+                return -1;
+            data = bounce.data();
+        }
+        uint32_t n = std::min<size_t>(left, block_size - in_block);
+        memcpy(buf + done, data + in_block, n);
+        done += n;
+        h->offset += n;
+    }
+    return count;
+}
+
+// write_inline writes to an inline file, which is rewritten whole: inline
+// if it still fits, in data blocks otherwise
+int FS::write_inline(struct open_file &h, const uint8_t *buf, size_t count)
+{
+    std::vector<uint8_t> data;
+    if (read_inline(h.slot, h.entry.size, data) != 0)
         return -1;
+    std::vector<uint8_t> old = data;
+    if (h.offset + count > data.size())
+        data.resize(h.offset + count);
+    memcpy(data.data() + h.offset, buf, count);
+
+    struct dir_entry grown = h.entry;
+    grown.size = data.size();
+    if (fits_inline(grown.size))
+    {
+        dir_remove(h.slot);
+        if (dir_insert(h.slot.dir_block, grown, data.data(), &h.slot) != 0)
+        {
+            std::cerr << "Directory full: " << grown.file_name << "\n";
+            dir_insert(h.slot.dir_block, h.entry, old.data(), &h.slot); // put it back
+            write_fat();
+            return -1;
+        }
     }
+    else
+    {
+        std::vector<unsigned> blocks;
+        if (allocate_chain((grown.size + block_size - 1) / block_size, 0, blocks) != 0)
+        {
+            std::cerr << "No free blocks left on disk.\n";
+            return -1;
+        }
+        write_chain(blocks, data.data(), grown.size);
+        grown.flags &= ~ENTRY_INLINE;
+        grown.first_blk = blocks[0];
+        dir_update(h.slot, grown);
+        write_fat();
+        h.block = FAT_EOF;
+        h.last_block = blocks.back();
+    }
+    h.entry = grown;
+    h.dir_version = dir_version;
+    h.offset += count;
+    return count;
+}
 
-    // 2. Resolve the filepath
-    std::vector<std::string> pathParts = resolve_path(filepath);
-    if (pathParts.empty())
+int64_t FS::write(int fd, const uint8_t *buf, size_t count)
+{
+    struct open_file *h = get_handle(fd);
+    if (h == nullptr || handle_entry(*h) != 0)
+        return -1;
+    if (!(h->mode & WRITE))
     {
-        std::cerr << "Invalid path." << std::endl;
+        std::cerr << "File not open for writing: " << h->entry.file_name << "\n";
         return -1;
     }
+    if (count == 0)
+        return 0;
+    uint64_t end = (uint64_t)h->offset + count;
+    if (end > UINT32_MAX)
+    {
+        std::cerr << "File too large: " << h->entry.file_name << "\n";
+        return -1;
+    }
+    if (is_inline(h->entry))
+        return write_inline(*h, buf, count);
 
-    // Backup the current directory block for restoration later
-    unsigned int backupCurrentDirectoryBlock = current_directory_block;
+    // Reserve the blocks the file grows by up front, right after its last
+    // block if possible
+    uint32_t old_size = h->entry.size;
+    size_t have = std::max<size_t>(1, (old_size + block_size - 1) / block_size);
+    size_t need = std::max<size_t>(1, (end + block_size - 1) / block_size);
+    bool grown = need > have;
+
+    // A block shared with a reflinked file is copied before it changes,
+    // a grown file changes the FAT link of its last block
+    uint32_t last = grown ? have - 1 : (end - 1) / block_size;
+    if (shared_blocks > 0 && last >= h->owned && unshare(*h, last) != 0)
+        return -1;
 
-    // Find the directory of the file/directory to change permissions
-    unsigned int currentBlock = current_directory_block;
-    struct dir_entry *dirEntry = nullptr;
-    for (size_t i = 0; i < pathParts.size() - 1; ++i)
+    if (grown)
     {
-        current_directory_block = currentBlock; // Update current directory
-        dirEntry = find_directory_entry(pathParts[i]);
-        if (dirEntry == nullptr || dirEntry->type != TYPE_DIR)
+        if (h->last_block == FAT_EOF)
+            h->last_block = h->block != FAT_EOF ? h->block : h->entry.first_blk;
+        while (fat[h->last_block] != FAT_EOF)
+            h->last_block = fat[h->last_block];
+        std::vector<unsigned> blocks;
+        if (allocate_chain(need - have, h->last_block + 1, blocks) != 0)
         {
-            std::cerr << "Directory not found: " << pathParts[i] << "\n";
-            current_directory_block = backupCurrentDirectoryBlock;
+            std::cerr << "No free blocks left on disk.\n";
             return -1;
         }
-        currentBlock = dirEntry->first_blk; // Move to the next directory in the path
+        set_fat(h->last_block, blocks[0]);
+        h->last_block = blocks.back();
+        // the new blocks are the file's own
+        if (h->owned >= have)
+            h->owned = need;
+    }
+
+    std::vector<unsigned> batch;
+    std::vector<uint8_t *> blks;
+    std::vector<uint8_t> bounce(block_size);
+    size_t done = 0;
+    while (done < count)
+    {
+        handle_seek_block(*h);
+        uint32_t in_block = h->offset - h->block_start;
+        size_t left = count - done;
+        if (in_block == 0 && left >= block_size)
+        {
+            // whole blocks are written from buf, with one vectored write
+            batch.clear();
+            blks.clear();
+            for (int32_t block = h->block;; block = fat[block])
+            {
+                batch.push_back(block);
+                blks.push_back(const_cast<uint8_t *>(buf) + done + (batch.size() - 1) * block_size);
+                left -= block_size;
+                if (fat[block] == FAT_EOF || left < block_size || batch.size() == CHAIN_BATCH_BLOCKS)
+                    break;
+            }
+            if (cache.writev(batch, blks) != 0)
+                return -1;
+            h->block = batch.back();
+            h->block_start += (batch.size() - 1) * block_size;
+            done += batch.size() * block_size;
+            h->offset += batch.size() * block_size;
+            continue;
+        }
+
+        // part of a block: what is there is kept, a block past the old end
+        // starts from zeros and isn't read
+        if (h->block_start >= old_size)
+            memset(bounce.data(), 0, block_size);
+        else if (cache.read(h->block, bounce.data()) != 0)
+            return -1;
+        uint32_t n = std::min<size_t>(left, block_size - in_block);
+        memcpy(bounce.data() + in_block, buf + done, n);
+        if (cache.write(h->block, bounce.data()) != 0)
+            return -1;
+        done += n;
+        h->offset += n;
     }
 
-    // Now, currentBlock is where the file/directory to change permissions should be
-    uint8_t dir_data[BLOCK_SIZE];
-    disk.read(currentBlock, dir_data);
-    struct dir_entry *dir_entries = reinterpret_cast<struct dir_entry *>(dir_data);
-    std::string targetName = pathParts.back(); // The last part is the name of the file/directory to change permissions
-    int entryIndex = find_directory_entry(targetName, dir_entries);
-    if (entryIndex == -1)
+    if (end > old_size)
     {
-        std::cerr << "Entry not found.\n";
-        current_directory_block = backupCurrentDirectoryBlock;
+        h->entry.size = end;
+        dir_update(h->slot, h->entry);
+        h->dir_version = dir_version;
+    }
+    if (grown)
+    {
+        // the next append starts at the new last block, unless a reflinked
+        // file may share it
+        if (shared_blocks == 0 || h->owned >= need)
+            keep_tail(h->entry.first_blk, h->last_block, h->owned);
+        write_fat();
+    }
+    return count;
+}
+
+// stream copies count bytes from the cursor of source to the cursor of
+// dest, a chunk at a time through one buffer, so memory doesn't grow with
+// the file. Before a chunk is read the disk is asked to read the next
+// stream_ahead chunks of the source in the background, they come in while
+// this one is written. echo gets a copy of the bytes if given.
+int FS::stream(int source, int dest, size_t count, std::ostream *echo)
+{
+    std::vector<uint8_t> chunk(std::clamp<size_t>(count, 1, (size_t)CHAIN_BATCH_BLOCKS * block_size));
+    // write may open handles and move the table, so nothing points into
+    // it; offset follows the source handle
+    uint64_t offset = handles[source].offset;
+    uint64_t end = offset + count;
+
+    // the next block to hint and its offset in the source. The chain is
+    // followed from the start once, a hint that turns out stale (e.g. the
+    // source was unshared under it) costs a read and nothing else.
+    int32_t ahead = is_inline(handles[source].entry) ? FAT_EOF : handles[source].entry.first_blk;
+    uint64_t ahead_start = 0;
+    std::vector<unsigned> hint;
+    while (offset < end)
+    {
+        uint64_t window = std::min<uint64_t>(end, offset + (uint64_t)(stream_ahead + 1) * chunk.size());
+        hint.clear();
+        while (ahead != FAT_EOF && ahead != FAT_FREE && ahead_start < window)
+        {
+            // the chunk read now is waited for anyway
+            if (ahead_start >= offset + chunk.size())
+                hint.push_back(ahead);
+            ahead = fat[ahead];
+            ahead_start += block_size;
+        }
+        if (!hint.empty())
+            device->prefetch(hint);
+
+        int64_t n = read(source, chunk.data(), std::min<uint64_t>(end - offset, chunk.size()));
+        if (n <= 0)
+            return -1;
+        offset += n;
+        if (echo != nullptr)
+            echo->write((const char *)chunk.data(), n);
+        if (write(dest, chunk.data(), n) != n)
+            return -1;
+    }
+    return 0;
+}
+
+int64_t FS::seek(int fd, int64_t offset, int whence)
+{
+    struct open_file *h = get_handle(fd);
+    if (h == nullptr || handle_entry(*h) != 0)
+        return -1;
+    int64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? h->offset : h->entry.size;
+    if ((whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) ||
+        base + offset < 0 || base + offset > h->entry.size)
+    {
+        std::cerr << "Invalid seek in file: " << h->entry.file_name << "\n";
         return -1;
     }
+    h->offset = base + offset;
+    return h->offset;
+}
 
-    // 3. Change the access rights
-    dir_entries[entryIndex].access_rights = newAccessRights;
+int FS::close(int fd)
+{
+    struct open_file *h = get_handle(fd);
+    if (h == nullptr)
+        return -1;
+    h->used = false;
+    return 0;
+}
 
-    // 4. Write back the modified directory entry to the disk
-    disk.write(currentBlock, dir_data);
+int FS::find_free_fat_entry(int start_idx)
+{
+    return free_map.find_free(start_idx); // -1 if no free FAT entries found
+}
+
+// FNV-1a, spreads similar names over the buckets
+static uint32_t dir_hash(std::string_view name)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char c : name)
+    {
+        h ^= c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// dir_chain returns the blocks of a directory, bucket n is the n-th one
+const std::vector<unsigned> &FS::dir_chain(unsigned dir_block)
+{
+    std::vector<unsigned> &chain = dir_chains[dir_block];
+    if (chain.empty())
+    {
+        // the root is block 0, which reads like FAT_FREE, so the first
+        // block is taken as it is
+        chain.push_back(dir_block);
+        for (int32_t block = fat[dir_block]; block != FAT_EOF && block != FAT_FREE; block = fat[block])
+            chain.push_back(block);
+    }
+    return chain;
+}
+
+// dir_bucket returns the block of the bucket a name hashes to, or of the
+// leaf it sorts into
+unsigned FS::dir_bucket(unsigned dir_block, std::string_view name)
+{
+    const std::vector<unsigned> &chain = dir_chain(dir_block);
+    if (name == "." || name == "..")
+        return chain[0];
+    if (dir_btree(dir_block))
+        return btree_leaf(dir_block, name);
+    uint32_t n = chain.size();
+    uint32_t low = 1u << (31 - __builtin_clz(n)); // 2^L <= n
+    uint32_t h = dir_hash(name);
+    uint32_t bucket = h & (low - 1);
+    if (bucket < n - low)
+        bucket = h & (2 * low - 1); // already split
+    return chain[bucket];
+}
+
+// dir_lookup finds name in a directory, only its bucket is read
+int FS::dir_lookup(unsigned dir_block, std::string_view name, struct dir_entry &entry, struct dir_slot *slot)
+{
+    if (name.empty())
+        return -1;
+    auto dir = dentries.find(dir_block);
+    if (dir != dentries.end())
+    {
+        dentry_key.assign(name.data(), name.size()); // no allocation once it has grown
+        auto cached = dir->second.find(dentry_key);
+        if (cached != dir->second.end())
+        {
+            dentry_hits++;
+            if (!cached->second.found)
+                return -1;
+            entry = cached->second.entry;
+            if (slot != nullptr)
+                *slot = cached->second.slot;
+            return 0;
+        }
+    }
+    dentry_misses++;
+
+    unsigned block_no = dir_bucket(dir_block, name);
+    const uint8_t *data = cache.get(block_no);
+    std::vector<uint8_t> dir_data;
+    if (data == nullptr)
+    {
+        dir_data.resize(block_size);
+        cache.read(block_no, dir_data.data());
+        data = dir_data.data();
+    }
+    struct dir_entry *entries = (struct dir_entry *)data;
+    int index = find_directory_entry(name, entries);
+    struct dentry d;
+    d.found = index != -1;
+    if (d.found)
+    {
+        d.entry = entries[index];
+        d.slot = {dir_block, block_no, (unsigned)index};
+    }
+    dentry_set(dir_block, name, d);
+    if (!d.found)
+        return -1;
+    entry = d.entry;
+    if (slot != nullptr)
+        *slot = d.slot;
+    return 0;
+}
+
+// dir_insert adds an entry to a directory, the caller checked that the
+// name is new. The directory grows until the bucket has a free slot, or
+// for an inline file with its data, enough free slots in a row. slot
+// gets where the entry went.
+int FS::dir_insert(unsigned dir_block, const struct dir_entry &entry, const uint8_t *data,
+                   struct dir_slot *slot)
+{
+    std::vector<uint8_t> dir_data(block_size);
+    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data.data());
+    bool btree = dir_btree(dir_block);
+    unsigned slots = entry_slots(entry);
+    while (true)
+    {
+        unsigned block_no = dir_bucket(dir_block, entry.file_name);
+        cache.read(block_no, dir_data.data());
+        int index = find_free_directory_entry(entries, slots);
+        if (index == -1 && slots > 1)
+        {
+            // the free entries may be there, just not in a row
+            dir_compact(entries);
+            dentry_drop(dir_block);
+            index = find_free_directory_entry(entries, slots);
+        }
+        if (index != -1)
+        {
+            entries[index] = entry;
+            uint8_t *slot_data = reinterpret_cast<uint8_t *>(&entries[index + 1]);
+            for (uint32_t off = 0; off < entry.size && slots > 1; off += INLINE_SLOT_DATA)
+            {
+                slot_data[0] = INLINE_MARK;
+                memcpy(slot_data + 1, data + off, std::min<uint32_t>(INLINE_SLOT_DATA, entry.size - off));
+                slot_data += sizeof(struct dir_entry);
+            }
+            dentry_set(dir_block, entry.file_name, {true, entry, {dir_block, block_no, (unsigned)index}});
+            dir_version++;
+            if (slot != nullptr)
+                *slot = {dir_block, block_no, (unsigned)index};
+            return cache.write(block_no, dir_data.data());
+        }
+        if ((btree ? btree_split(dir_block, entry.file_name) : dir_split(dir_block)) != 0)
+            return -1;
+    }
+}
+
+// dir_update overwrites the entry in a slot found by dir_lookup, the
+// name must stay the same
+int FS::dir_update(const struct dir_slot &slot, const struct dir_entry &entry)
+{
+    std::vector<uint8_t> dir_data(block_size);
+    cache.read(slot.block_no, dir_data.data());
+    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data.data());
+    struct dir_entry &old = entries[slot.index];
+    // the data of an inline file goes unless it stays the same
+    if (is_inline(old) && !(is_inline(entry) && entry.size == old.size))
+        memset(&entries[slot.index + 1], 0, (entry_slots(old) - 1) * sizeof(struct dir_entry));
+    if (old.file_name[0] != '\0')
+    {
+        struct dentry d = {entry.file_name[0] != '\0', entry, slot};
+        dentry_set(slot.dir_block, old.file_name, d);
+    }
+    dir_version++;
+    old = entry;
+    return cache.write(slot.block_no, dir_data.data());
+}
+
+// dir_remove clears the entry in a slot found by dir_lookup
+int FS::dir_remove(const struct dir_slot &slot)
+{
+    struct dir_entry empty;
+    memset(&empty, 0, sizeof(empty));
+    return dir_update(slot, empty);
+}
 
-    current_directory_block = backupCurrentDirectoryBlock; // Restore original current directory
+// dir_for_each calls fn for every entry of a directory, bucket by bucket,
+// until fn returns false
+int FS::dir_for_each(unsigned dir_block, const std::function<bool(const struct dir_entry &)> &fn)
+{
+    std::vector<uint8_t> dir_data(block_size);
+    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data.data());
+    std::vector<unsigned> chain = dir_chain(dir_block);
+    bool btree = dir_btree(dir_block);
+    for (unsigned block_no : chain)
+    {
+        if (cache.read(block_no, dir_data.data()) != 0)
+            return -1;
+        // The first block of a B+tree holds ".." and the tree header, of
+        // the nodes only the leaves hold entries
+        if (btree && block_no == dir_block)
+        {
+            if (!fn(entries[0]))
+                return 0;
+            continue;
+        }
+        if (btree && entries[0].type != NODE_LEAF)
+            continue;
+        for (unsigned base = 0; base < entries_per_block; base += DIRSCAN_BATCH)
+        {
+            unsigned count = std::min(entries_per_block - base, (unsigned)DIRSCAN_BATCH);
+            uint64_t used = dirscan_used(dir_data.data() + base * DIRSCAN_ENTRY_SIZE, count);
+            if (btree && base == 0)
+                used &= ~1ULL; // the node header
+            for (; used != 0; used &= used - 1)
+            {
+                const struct dir_entry &entry = entries[base + __builtin_ctzll(used)];
+                if (is_entry(entry) && !fn(entry))
+                    return 0;
+            }
+        }
+    }
     return 0;
 }
 
-struct dir_entry *FS::find_directory_entry(std::string name)
+// dir_split grows a directory by one bucket. With N buckets, bucket
+// N - 2^L is split: the entries whose hash mod 2^(L+1) is N move to the
+// new block at the end of the chain.
+int FS::dir_split(unsigned dir_block)
 {
-    uint8_t current_dir_data[BLOCK_SIZE];
-    disk.read(current_directory_block, current_dir_data);
-    struct dir_entry *current_dir_entries = reinterpret_cast<struct dir_entry *>(current_dir_data);
+    const std::vector<unsigned> &chain = dir_chain(dir_block);
+    uint32_t n = chain.size();
+    uint32_t low = 1u << (31 - __builtin_clz(n));
+    uint32_t split = n - low;
 
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    unsigned new_block;
+    if (dir_grow(dir_block, new_block) != 0)
+        return -1;
+
+    std::vector<uint8_t> old_data(block_size), new_data(block_size, 0);
+    struct dir_entry *old_entries = reinterpret_cast<struct dir_entry *>(old_data.data());
+    struct dir_entry *new_entries = reinterpret_cast<struct dir_entry *>(new_data.data());
+    cache.read(chain[split], old_data.data());
+    unsigned moved = 0;
+    for (unsigned base = 0; base < entries_per_block; base += DIRSCAN_BATCH)
     {
-        std::cout << "Comparing against: " << current_dir_entries[i].file_name
-                  << ", Type: " << (int)current_dir_entries[i].type
-                  << ", First Block: " << current_dir_entries[i].first_blk << "\n"; // Debug print
-        if (strcmp(current_dir_entries[i].file_name, name.c_str()) == 0)
+        unsigned count = std::min(entries_per_block - base, (unsigned)DIRSCAN_BATCH);
+        uint64_t used = dirscan_used(old_data.data() + base * DIRSCAN_ENTRY_SIZE, count);
+        for (; used != 0; used &= used - 1)
         {
-            return &current_dir_entries[i];
+            unsigned i = base + __builtin_ctzll(used);
+            const char *name = old_entries[i].file_name;
+            if (!is_entry(old_entries[i])) // inline data moves with its entry
+                continue;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+            if ((dir_hash(name) & (2 * low - 1)) != n)
+                continue;
+            unsigned slots = entry_slots(old_entries[i]);
+            std::copy(old_entries + i, old_entries + i + slots, new_entries + moved);
+            moved += slots;
+            memset(&old_entries[i], 0, slots * sizeof(struct dir_entry));
         }
     }
+    cache.write(chain[split], old_data.data());
+    cache.write(new_block, new_data.data());
+
+    // the moved entries changed slots, and names looked up from now on
+    // hash over one more bucket
+    dentry_drop(dir_block);
+    return write_fat();
+}
+
+// dir_grow links a new block to the end of the chain of a directory, its
+// content is up to the caller
+int FS::dir_grow(unsigned dir_block, unsigned &block_no)
+{
+    dir_chain(dir_block); // loaded before it grows
+    std::vector<unsigned> &chain = dir_chains[dir_block];
+    std::vector<unsigned> new_block;
+    if (allocate_chain(1, chain.back() + 1, new_block) != 0)
+    {
+        std::cerr << "No free blocks left on disk.\n";
+        return -1;
+    }
+    set_fat(chain.back(), new_block[0]);
+    chain.push_back(new_block[0]);
+    block_no = new_block[0];
+    return 0;
+}
+
+// dir_btree tells if a directory is kept as a B+tree, from its ".."
+bool FS::dir_btree(unsigned dir_block)
+{
+    const uint8_t *data = cache.get(dir_block);
+    std::vector<uint8_t> dir_data;
+    if (data == nullptr)
+    {
+        dir_data.resize(block_size);
+        cache.read(dir_block, dir_data.data());
+        data = dir_data.data();
+    }
+    return reinterpret_cast<const struct dir_entry *>(data)[0].flags & ENTRY_BTREE;
+}
+
+// btree_leaf walks a B+tree directory down to the leaf for name. path
+// gets the internal nodes on the way, from the root down.
+unsigned FS::btree_leaf(unsigned dir_block, std::string_view name, std::vector<unsigned> *path)
+{
+    std::vector<uint8_t> node_data(block_size);
+    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(node_data.data());
+    cache.read(dir_block, node_data.data());
+    unsigned block_no = entries[1].first_blk;
+    while (cache.read(block_no, node_data.data()) == 0 && entries[0].type == NODE_INTERNAL)
+    {
+        if (path != nullptr)
+            path->push_back(block_no);
+        // the child of the last key up to name, or the one below all keys
+        struct dir_entry *keys = entries + 1;
+        struct dir_entry *next = std::upper_bound(keys, keys + entries[0].size, name,
+                                                  [](std::string_view n, const struct dir_entry &key)
+                                                  { return n < std::string_view(key.file_name); });
+        block_no = next == keys ? entries[0].first_blk : (next - 1)->first_blk;
+    }
+    return block_no;
+}
+
+// btree_split splits the full leaf name sorts into: the upper half of its
+// names moves to a new leaf, and the first of them goes up as a key
+int FS::btree_split(unsigned dir_block, std::string_view name)
+{
+    std::vector<unsigned> path;
+    unsigned leaf = btree_leaf(dir_block, name, &path);
+
+    std::vector<uint8_t> leaf_data(block_size), new_data(block_size, 0);
+    struct dir_entry *leaf_entries = reinterpret_cast<struct dir_entry *>(leaf_data.data());
+    struct dir_entry *new_entries = reinterpret_cast<struct dir_entry *>(new_data.data());
+    cache.read(leaf, leaf_data.data());
+    const std::vector<uint8_t> old_data = leaf_data;
+    const struct dir_entry *old_entries = reinterpret_cast<const struct dir_entry *>(old_data.data());
+    std::vector<unsigned> sorted; // the entries by name, with their inline data
+    unsigned total = 0;
+    for (unsigned i = 1; i < entries_per_block; ++i)
+    {
+        if (!is_entry(old_entries[i]))
+            continue;
+        sorted.push_back(i);
+        total += entry_slots(old_entries[i]);
+    }
+    if (sorted.empty())
+        return -1;
+    std::sort(sorted.begin(), sorted.end(), [old_entries](unsigned a, unsigned b)
+              { return entry_name_less(old_entries[a], old_entries[b]); });
+    // the names taking the lower half of the slots stay
+    unsigned half = 0, kept = 0;
+    while (half + 1 < sorted.size() && kept < total / 2)
+        kept += entry_slots(old_entries[sorted[half++]]);
+
+    unsigned new_leaf;
+    if (dir_grow(dir_block, new_leaf) != 0)
+        return -1;
+    set_node_header(new_entries[0], NODE_LEAF, leaf_entries[0].first_blk, 0);
+    leaf_entries[0].first_blk = new_leaf;
+    memset(leaf_entries + 1, 0, (entries_per_block - 1) * sizeof(struct dir_entry));
+    unsigned left = 1, right = 1;
+    for (unsigned h = 0; h < sorted.size(); ++h)
+    {
+        const struct dir_entry *from = old_entries + sorted[h];
+        unsigned slots = entry_slots(*from);
+        std::copy(from, from + slots, h < half ? leaf_entries + left : new_entries + right);
+        (h < half ? left : right) += slots;
+    }
+    cache.write(leaf, leaf_data.data());
+    cache.write(new_leaf, new_data.data());
+
+    // the moved entries changed slots
+    dentry_drop(dir_block);
+
+    struct dir_entry key;
+    memset(&key, 0, sizeof(key));
+    strcpy(key.file_name, old_entries[sorted[half]].file_name);
+    key.first_blk = new_leaf;
+    if (btree_add_key(dir_block, path, key) != 0)
+        return -1;
+    return write_fat();
+}
+
+// btree_add_key adds the key of a new child to the lowest node on path.
+// A full node moves its upper keys to a new node and the middle key goes
+// up to its parent in turn, a full root gets a new root above it.
+int FS::btree_add_key(unsigned dir_block, std::vector<unsigned> &path, struct dir_entry key)
+{
+    std::vector<uint8_t> node_data(block_size), new_data(block_size);
+    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(node_data.data());
+    struct dir_entry *new_entries = reinterpret_cast<struct dir_entry *>(new_data.data());
+    unsigned max_keys = entries_per_block - 1;
+    for (; !path.empty(); path.pop_back())
+    {
+        unsigned node = path.back();
+        cache.read(node, node_data.data());
+        unsigned n = entries[0].size;
+        struct dir_entry *keys = entries + 1;
+        struct dir_entry *pos = std::upper_bound(keys, keys + n, key, entry_name_less);
+        if (n < max_keys)
+        {
+            std::copy_backward(pos, keys + n, keys + n + 1);
+            *pos = key;
+            entries[0].size = n + 1;
+            return cache.write(node, node_data.data());
+        }
 
-    return nullptr; // Return null if the name doesn't exist in the current directory.
+        std::vector<struct dir_entry> all(keys, pos);
+        all.push_back(key);
+        all.insert(all.end(), pos, keys + n);
+        unsigned mid = all.size() / 2;
+        unsigned new_node;
+        if (dir_grow(dir_block, new_node) != 0)
+            return -1;
+        std::fill(new_data.begin(), new_data.end(), 0);
+        set_node_header(new_entries[0], NODE_INTERNAL, all[mid].first_blk, all.size() - mid - 1);
+        std::copy(all.begin() + mid + 1, all.end(), new_entries + 1);
+        memset(keys, 0, max_keys * sizeof(struct dir_entry));
+        std::copy(all.begin(), all.begin() + mid, keys);
+        entries[0].size = mid;
+        cache.write(node, node_data.data());
+        cache.write(new_node, new_data.data());
+        key = all[mid];
+        key.first_blk = new_node;
+    }
+
+    // The root was split, or was a leaf
+    unsigned root;
+    if (dir_grow(dir_block, root) != 0)
+        return -1;
+    cache.read(dir_block, node_data.data());
+    std::fill(new_data.begin(), new_data.end(), 0);
+    set_node_header(new_entries[0], NODE_INTERNAL, entries[1].first_blk, 1);
+    new_entries[1] = key;
+    entries[1].first_blk = root;
+    cache.write(root, new_data.data());
+    return cache.write(dir_block, node_data.data());
 }
 
-int FS::find_directory_entry(const std::string &name, dir_entry *entries)
+// dir_list calls fn in name order for the entries that start with prefix
+// and come after `after`, until fn returns false. A B+tree is read from
+// the leaf the listing starts in on, a hashed directory whole.
+int FS::dir_list(unsigned dir_block, std::string_view prefix, std::string_view after,
+                 const std::function<bool(const struct dir_entry &)> &fn)
 {
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    auto wanted = [&](std::string_view name)
+    { return name > after && name.substr(0, prefix.size()) == prefix; };
+    std::vector<struct dir_entry> sorted;
+    if (!dir_btree(dir_block))
+    {
+        int ret = dir_for_each(dir_block, [&](const struct dir_entry &entry)
+                               {
+            if (wanted(entry.file_name))
+                sorted.push_back(entry);
+            return true; });
+        if (ret != 0)
+            return -1;
+        std::sort(sorted.begin(), sorted.end(), entry_name_less);
+        for (const struct dir_entry &entry : sorted)
+        {
+            if (!fn(entry))
+                break;
+        }
+        return 0;
+    }
+
+    std::vector<uint8_t> dir_data(block_size);
+    struct dir_entry *entries = reinterpret_cast<struct dir_entry *>(dir_data.data());
+    if (cache.read(dir_block, dir_data.data()) != 0)
+        return -1;
+    // ".." is not in the tree, it goes out in its place in the order
+    struct dir_entry parent = entries[0];
+    bool parent_wanted = wanted(parent.file_name);
+    unsigned leaf = btree_leaf(dir_block, std::max(prefix, after));
+    while (leaf != 0)
     {
-        if (strcmp(entries[i].file_name, name.c_str()) == 0)
+        if (cache.read(leaf, dir_data.data()) != 0)
+            return -1;
+        // a name past the ones with the prefix ends the listing after this leaf
+        bool past = false;
+        sorted.clear();
+        for (unsigned i = 1; i < entries_per_block; ++i)
+        {
+            if (!is_entry(entries[i]))
+                continue;
+            std::string_view name = entries[i].file_name;
+            if (wanted(name))
+                sorted.push_back(entries[i]);
+            else if (name > prefix && name.substr(0, prefix.size()) != prefix)
+                past = true;
+        }
+        std::sort(sorted.begin(), sorted.end(), entry_name_less);
+        for (const struct dir_entry &entry : sorted)
         {
-            return i;
+            if (parent_wanted && entry_name_less(parent, entry))
+            {
+                parent_wanted = false;
+                if (!fn(parent))
+                    return 0;
+            }
+            if (!fn(entry))
+                return 0;
         }
+        if (past)
+            break;
+        leaf = entries[0].first_blk;
     }
-    return -1; // Not found
+    if (parent_wanted)
+        fn(parent);
+    return 0;
+}
+
+// dir_forget drops what is cached about a directory, for a directory
+// that was removed or a block that becomes a new directory
+void FS::dir_forget(unsigned dir_block)
+{
+    dir_chains.erase(dir_block);
+    dir_links.erase(dir_block);
+    dentry_drop(dir_block);
 }
 
-int FS::find_free_directory_entry(dir_entry *entries)
+// dentry_drop forgets the cached lookups in a directory
+void FS::dentry_drop(unsigned dir_block)
 {
-    for (int i = 0; i < (BLOCK_SIZE / sizeof(struct dir_entry)); ++i)
+    dir_version++;
+    auto dir = dentries.find(dir_block);
+    if (dir != dentries.end())
     {
-        if (entries[i].file_name[0] == '\0')
-        { // Unused entries have an empty filename
-            return i;
+        dentry_count -= dir->second.size();
+        dentries.erase(dir);
+    }
+}
+
+// dentry_set caches the lookup of a name in a directory. When the cache
+// is full it starts over, the hot names come back on their next lookup.
+void FS::dentry_set(unsigned dir_block, std::string_view name, const struct dentry &d)
+{
+    if (dentry_limit == 0)
+        return;
+    dentry_key.assign(name.data(), name.size());
+    auto &dir = dentries[dir_block];
+    auto cached = dir.find(dentry_key);
+    if (cached != dir.end())
+    {
+        cached->second = d;
+        return;
+    }
+    if (dentry_count >= dentry_limit)
+    {
+        dentries.clear();
+        dentry_count = 0;
+    }
+    dentries[dir_block].emplace(dentry_key, d);
+    dentry_count++;
+}
+
+void FS::set_dentry_limit(size_t limit)
+{
+    dentry_limit = limit;
+    dentries.clear();
+    dentry_count = 0;
+}
+
+void FS::set_tail_hints(bool on)
+{
+    tail_hints = on;
+    tails.clear();
+    tail_heads.clear();
+}
+
+void FS::set_walk_threads(unsigned threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    walk_threads = std::max(1u, std::min(threads, (unsigned)WALK_THREADS_MAX));
+}
+
+// dir_rights returns the access rights of a directory, kept in the first
+// entry of its first block ("." for the root, ".." otherwise)
+uint8_t FS::dir_rights(unsigned dir_block)
+{
+    const uint8_t *data = cache.get(dir_block);
+    std::vector<uint8_t> dir_data;
+    if (data == nullptr)
+    {
+        dir_data.resize(block_size);
+        cache.read(dir_block, dir_data.data());
+        data = dir_data.data();
+    }
+    return reinterpret_cast<const struct dir_entry *>(data)[0].access_rights;
+}
+
+// free_chain returns every block of a chain to the free space. Their
+// content no longer matters, cached copies are dropped unwritten.
+void FS::free_chain(unsigned first_blk)
+{
+    int32_t block = first_blk;
+    while (block != FAT_EOF && block != FAT_FREE)
+    {
+        int32_t next = fat[block];
+        set_fat(block, FAT_FREE);
+        cache.discard(block);
+        // the rest is still shared with a reflinked file
+        if (next > 0 && block_refs[next] > 0)
+            break;
+        block = next;
+    }
+}
+
+// add_reflink adds a file sharing the chain of source. Its first block is
+// a copy, so a file's first block is never shared and a block with
+// more than one FAT link into it is.
+int FS::add_reflink(const struct dir_entry &source, unsigned dir_block, std::string_view name)
+{
+    std::vector<unsigned> first;
+    if (allocate_chain(1, source.first_blk + 1, first) != 0)
+    {
+        std::cerr << "No free blocks left on disk.\n";
+        return -1;
+    }
+    std::vector<uint8_t> data(block_size);
+    if (cache.read(source.first_blk, data.data()) != 0 || cache.write(first[0], data.data()) != 0)
+    {
+        free_chain(first[0]);
+        write_fat();
+        return -1;
+    }
+    set_fat(first[0], fat[source.first_blk]);
+
+    struct dir_entry entry = source;
+    set_entry_name(entry, name);
+    entry.first_blk = first[0];
+    if (dir_insert(dir_block, entry) != 0)
+    {
+        std::cerr << "Directory full: " << name << "\n";
+        free_chain(first[0]);
+        write_fat();
+        return -1;
+    }
+    // the blocks of the source are shared now
+    drop_tail(source.first_blk);
+    for (struct open_file &h : handles)
+    {
+        if (h.used && h.entry.first_blk == source.first_blk)
+            h.owned = 0;
+    }
+    return write_fat();
+}
+
+// unshare gives the file of h its own copies of its blocks up to the
+// one at index last, from the first block it shares on. The blocks
+// before a shared one are copied too, their FAT links lead to it, but
+// the blocks after last stay shared.
+int FS::unshare(struct open_file &h, uint32_t last)
+{
+    int32_t prev = h.entry.first_blk;
+    uint32_t index = 1;
+    while (index <= last && block_refs[fat[prev]] < 2)
+    {
+        prev = fat[prev];
+        index++;
+    }
+    if (index <= last)
+    {
+        std::vector<unsigned> shared, copies;
+        for (int32_t block = fat[prev]; shared.size() <= last - index; block = fat[block])
+            shared.push_back(block);
+        if (allocate_chain(shared.size(), prev + 1, copies) != 0)
+        {
+            std::cerr << "No free blocks left on disk.\n";
+            return -1;
+        }
+        std::vector<uint8_t> buffer((size_t)std::min<size_t>(shared.size(), CHAIN_BATCH_BLOCKS) * block_size);
+        std::vector<uint8_t *> blks;
+        for (size_t i = 0; i < shared.size(); i += CHAIN_BATCH_BLOCKS)
+        {
+            size_t n = std::min<size_t>(shared.size() - i, CHAIN_BATCH_BLOCKS);
+            blks.clear();
+            for (size_t j = 0; j < n; ++j)
+                blks.push_back(buffer.data() + j * block_size);
+            std::vector<unsigned> from(shared.begin() + i, shared.begin() + i + n);
+            std::vector<unsigned> to(copies.begin() + i, copies.begin() + i + n);
+            if (cache.readv(from, blks) != 0 || cache.writev(to, blks) != 0)
+            {
+                free_chain(copies[0]);
+                write_fat();
+                return -1;
+            }
+        }
+        set_fat(copies.back(), fat[shared.back()]);
+        set_fat(prev, copies[0]);
+        write_fat();
+        // the last block may have been copied as well
+        drop_tail(h.entry.first_blk);
+        // the blocks the handles of the file are on may be the old ones
+        for (struct open_file &other : handles)
+        {
+            if (other.used && other.entry.first_blk == h.entry.first_blk)
+                other.block = other.last_block = FAT_EOF;
         }
     }
-    return -1; // No free entries
+    h.owned = last + 1;
+    return 0;
 }
 
-int FS::find_free_fat_entry(int start_idx)
+// keep_tail remembers the last block of a file whose chain was walked or
+// grown, the file's own up to there
+void FS::keep_tail(unsigned first_blk, int32_t last_block, uint32_t owned)
+{
+    drop_tail(first_blk);
+    if (!tail_hints)
+        return;
+    tails[first_blk] = {last_block, owned};
+    tail_heads[last_block] = first_blk;
+}
+
+// drop_tail forgets the tail of the chain block_no is the first or the
+// last block of
+void FS::drop_tail(unsigned block_no)
 {
-    for (int i = start_idx; i < (BLOCK_SIZE / 2); ++i)
+    auto tail = tails.find(block_no);
+    if (tail != tails.end())
     {
-        if (fat[i] == FAT_FREE)
+        tail_heads.erase(tail->second.block);
+        tails.erase(tail);
+        return;
+    }
+    auto head = tail_heads.find(block_no);
+    if (head != tail_heads.end())
+    {
+        tails.erase(head->second);
+        tail_heads.erase(head);
+    }
+}
+
+// collect_tree gathers the first blocks of the directories and of the
+// files with data blocks below dir_block, dir_block included. It changes
+// nothing and fails if a directory can't be written or is the current one.
+int FS::collect_tree(unsigned dir_block, std::vector<unsigned> &dirs, std::vector<unsigned> &files)
+{
+    dirs.push_back(dir_block);
+    for (size_t next = dirs.size() - 1; next < dirs.size(); ++next)
+    {
+        unsigned dir = dirs[next];
+        if (dir == current_directory_block)
+        {
+            std::cerr << "Error: Directory holds the current directory.\n";
+            return -1;
+        }
+        if (!(dir_rights(dir) & WRITE))
         {
-            return i;
+            std::cerr << "Write permission denied for a directory below.\n";
+            return -1;
         }
+        int ret = dir_for_each(dir, [&](const struct dir_entry &entry)
+                               {
+            if (strcmp(entry.file_name, ".") == 0 || strcmp(entry.file_name, "..") == 0)
+                return true;
+            if (entry.type == TYPE_DIR)
+                dirs.push_back(entry.first_blk);
+            else if (!is_inline(entry))
+                files.push_back(entry.first_blk);
+            return true; });
+        if (ret != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// free_tree frees the chains of the directories and files collect_tree
+// gathered
+void FS::free_tree(const std::vector<unsigned> &dirs, const std::vector<unsigned> &files)
+{
+    for (unsigned first_blk : files)
+        free_chain(first_blk);
+    for (unsigned dir : dirs)
+    {
+        free_chain(dir);
+        dir_forget(dir);
     }
-    return -1; // No free FAT entries found
 }
 
-std::vector<std::string> FS::resolve_path(std::string path)
+// chain_blocks counts the blocks of a chain, from the FAT alone so a
+// tree walk can call it from any thread
+unsigned FS::chain_blocks(unsigned first_blk) const
 {
-    std::vector<std::string> parts;
-    std::stringstream path_stream(path);
-    std::string part;
+    // the first block is taken as it is, the root reads like FAT_FREE
+    unsigned count = 1;
+    for (int32_t block = fat[first_blk]; block != FAT_EOF && block != FAT_FREE && count < fat.size(); block = fat[block])
+        count++;
+    return count;
+}
+
+// walk_tree calls fn for every entry below dir_block, whose path is path,
+// with the worker number, the path of the directory holding the entry and
+// the entry. The directories are read on walk_threads threads, so fn must
+// be thread safe; results are best gathered per worker. Directories
+// without read rights are skipped.
+int FS::walk_tree(unsigned dir_block, const std::string &path,
+                  const std::function<void(unsigned, const std::string &, const struct dir_entry &)> &fn)
+{
+    // The workers read directory blocks from the device, past the cache,
+    // which isn't thread safe, with read_concurrent. Nothing changes
+    // during the walk, so once the cache is written back the device holds
+    // every directory and the FAT in memory is only read.
+    if (cache.sync() != 0)
+        return -1;
+    std::atomic<bool> failed{false};
+    std::atomic<unsigned> denied{0};
+
+    TreeWalker walker(walk_threads);
+    walker.run({dir_block, path}, [&](TreeWalker &w, unsigned self, const struct walk_task &task)
+               {
+        std::vector<uint8_t> dir_data(block_size);
+        const struct dir_entry *entries = reinterpret_cast<const struct dir_entry *>(dir_data.data());
+        bool btree = false;
+        int32_t block = task.dir_block;
+        do
+        {
+            if (device->read_concurrent(block, dir_data.data()) != 0)
+            {
+                failed = true;
+                return;
+            }
+            if (block == (int32_t)task.dir_block)
+            {
+                if (!(entries[0].access_rights & READ))
+                {
+                    denied++;
+                    return;
+                }
+                btree = entries[0].flags & ENTRY_BTREE;
+            }
+            // as in dir_for_each, of a B+tree only the leaves hold entries
+            if (btree && (block == (int32_t)task.dir_block || entries[0].type != NODE_LEAF))
+                continue;
+            for (unsigned base = 0; base < entries_per_block; base += DIRSCAN_BATCH)
+            {
+                unsigned count = std::min(entries_per_block - base, (unsigned)DIRSCAN_BATCH);
+                uint64_t used = dirscan_used(dir_data.data() + base * DIRSCAN_ENTRY_SIZE, count);
+                if (btree && base == 0)
+                    used &= ~1ULL; // the node header
+                for (; used != 0; used &= used - 1)
+                {
+                    const struct dir_entry &entry = entries[base + __builtin_ctzll(used)];
+                    if (!is_entry(entry) || strcmp(entry.file_name, ".") == 0 || strcmp(entry.file_name, "..") == 0)
+                        continue;
+                    fn(self, task.path, entry);
+                    if (entry.type == TYPE_DIR)
+                        w.push(self, {entry.first_blk, (task.path == "/" ? "/" : task.path + "/") + entry.file_name});
+                }
+            }
+        } while ((block = fat[block]) != FAT_EOF && block != FAT_FREE); });
 
-    while (std::getline(path_stream, part, '/'))
+    if (denied > 0)
+        std::cerr << "Read permission denied for " << denied << " directories below.\n";
+    return failed ? -1 : 0;
+}
+
+// allocate_chain reserves count blocks, contiguous after hint if possible,
+// and links them into a FAT chain. blocks gets the chain in order.
+int FS::allocate_chain(unsigned count, unsigned hint, std::vector<unsigned> &blocks)
+{
+    std::vector<extent> extents;
+    if (free_map.reserve(count, hint, extents) != 0)
+        return -1;
+    blocks.clear();
+    for (const extent &e : extents)
     {
-        if (part == "" || part == ".")
-            continue; // Skip 'current directory' parts
-        // Don't remove ".." parts here, let the cd command handle them
-        parts.push_back(part);
+        for (uint32_t i = 0; i < e.length; ++i)
+            blocks.push_back(e.start + i);
     }
-    return parts;
+    for (size_t i = 0; i < blocks.size(); ++i)
+        set_fat(blocks[i], (i + 1 < blocks.size()) ? blocks[i + 1] : FAT_EOF);
+    return 0;
 }
 
-std::vector<std::string> FS::resolve_path_for_cp_and_mv(std::string path)
+// take_blocks hands out the next count blocks planned for a batch as a
+// chain of their own, outside a batch it allocates them
+int FS::take_blocks(unsigned count, unsigned hint, std::vector<unsigned> &blocks)
 {
-    std::vector<std::string> parts;
-    std::stringstream path_stream(path);
-    std::string part;
+    if (batch_next + count > batch_blocks.size())
+        return allocate_chain(count, hint, blocks);
+    // the planned blocks are one chain, cut it after the last one
+    blocks.assign(batch_blocks.begin() + batch_next, batch_blocks.begin() + batch_next + count);
+    batch_next += count;
+    set_fat(blocks.back(), FAT_EOF);
+    return 0;
+}
 
-    while (std::getline(path_stream, part, '/'))
+// writes size bytes of data along blocks, with one vectored write. The
+// last block is zero padded.
+int FS::write_chain(const std::vector<unsigned> &blocks, uint8_t *data, size_t size)
+{
+    std::vector<uint8_t> last(block_size, 0);
+    std::vector<uint8_t *> blks(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i)
     {
-        if (part == "" || part == ".")
-            continue; // Skip 'current directory' parts
-        if (part == "..")
+        size_t offset = i * block_size;
+        if (offset + block_size <= size)
         {
-            if (!parts.empty())
-                parts.pop_back(); // Move up one directory
+            blks[i] = data + offset;
             continue;
         }
-        parts.push_back(part);
+        if (offset < size)
+            memcpy(last.data(), data + offset, size - offset);
+        blks[i] = last.data();
+    }
+    return cache.writev(blocks, blks);
+}
+
+// walk_path resolves every component of path but the last one, from the
+// root for absolute paths and from the current directory otherwise.
+// dir_block gets the directory the last component is in and name the
+// last component, empty if the path names no entry (like "/" or ".").
+// name points into path.
+int FS::walk_path(std::string_view path, unsigned &dir_block, std::string_view &name)
+{
+    PathIterator it(path);
+    unsigned block = it.absolute() ? ROOT_BLOCK : current_directory_block;
+    std::string_view part, next;
+    bool more = it.next(part);
+    while (more && it.next(next))
+    {
+        struct dir_entry entry;
+        if (dir_lookup(block, part, entry) != 0 || entry.type != TYPE_DIR)
+        {
+            std::cerr << "Directory not found: " << part << "\n";
+            return -1;
+        }
+        block = entry.first_blk;
+        part = next;
     }
-    return parts;
-}
\ No newline at end of file
+    dir_block = block;
+    name = more ? part : std::string_view();
+    return 0;
+}
+
+// walk_dir resolves a path that names a directory
+int FS::walk_dir(std::string_view path, unsigned &dir_block)
+{
+    std::string_view name;
+    struct dir_entry entry;
+    if (walk_path(path, dir_block, name) != 0)
+        return -1;
+    if (name.empty())
+        return 0;
+    if (dir_lookup(dir_block, name, entry) != 0 || entry.type != TYPE_DIR)
+    {
+        std::cerr << "Directory " << name << " not found.\n";
+        return -1;
+    }
+    dir_block = entry.first_blk;
+    return 0;
+}
+
+// name_fits tells whether an entry can hold a name, a cut name could
+// clash with another one cut the same way
+bool FS::name_fits(std::string_view name)
+{
+    if (name.size() < sizeof(dir_entry::file_name))
+        return true;
+    std::cerr << "Name too long: " << name << "\n";
+    return false;
+}
+
+// set_entry_name copies a name into an entry, the commands that make
+// entries checked it with name_fits
+void FS::set_entry_name(struct dir_entry &entry, std::string_view name)
+{
+    memset(entry.file_name, 0, sizeof(entry.file_name));
+    memcpy(entry.file_name, name.data(), name.size());
+}
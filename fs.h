@@ -1,7 +1,20 @@
 #include <iostream>
 #include <cstdint>
 #include <vector>
+#include <functional>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <string_view>
 #include "disk.h"
+#include "device.h"
+#include "cache.h"
+#include "freemap.h"
+#include "stats.h"
+#include "path.h"
+#include "dirscan.h"
+#include "walker.h"
 
 #ifndef __FS_H__
 #define __FS_H__
@@ -10,6 +23,9 @@
 #define FAT_BLOCK 1
 #define FAT_FREE 0
 #define FAT_EOF -1
+#define FAT_MAX_BLOCKS 0x7fffffff // FAT entries are signed 32 bits
+#define CHAIN_BATCH_BLOCKS 64 // blocks per vectored read of a file
+#define STREAM_AHEAD 3 // chunks cp and append ask the disk to read ahead
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
@@ -18,68 +34,324 @@
 #define EXECUTE 0x01
 
 struct dir_entry {
-    char file_name[56]; // name of the file / sub-directory
+    char file_name[52]; // name of the file / sub-directory
     uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
+    uint32_t first_blk; // index in the FAT for the first block of the file
     uint8_t type; // directory (1) or file (0)
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+    uint8_t flags; // ENTRY_* bits, zero in older images
+};
+static_assert(sizeof(struct dir_entry) == DIRSCAN_ENTRY_SIZE, "dir_entry must stay 64 bytes");
+
+// A directory is a linear hash table over its FAT chain: the n-th block
+// of the chain is bucket n. With N buckets and 2^L <= N < 2^(L+1), a name
+// goes to bucket hash mod 2^L, or hash mod 2^(L+1) if that bucket has
+// already been split. A full bucket makes the directory grow by one block,
+// splitting the next bucket in line. "." and ".." stay in the first block,
+// so an old single-block directory is a table with one bucket.
+//
+// A directory made with mkdir --btree keeps its names in a B+tree instead,
+// flagged by ENTRY_BTREE on its "..". Its first block holds ".." and a
+// NODE_ROOT header pointing at the root node. Every node starts with a
+// header entry: a leaf holds the entries of a range of names in any order
+// and links to the next leaf, an internal node holds sorted keys, each
+// with the child for the names from it up to the next key. The nodes are
+// on the FAT chain of the directory like the buckets of a hashed one.
+
+#define ENTRY_BTREE 0x01 // on ".." of a directory kept as a B+tree
+#define ENTRY_INLINE 0x02 // a file whose data follows its entry
+
+// A small file can be kept inline: its data fills the slots right after
+// its entry in the directory block, INLINE_SLOT_DATA bytes per slot after
+// an INLINE_MARK byte, and it has no data blocks. Its first_blk is the
+// root block, which no file on an older image starts at, so a flags byte
+// left uninitialized by older builds is not taken for ENTRY_INLINE.
+#define INLINE_MARK 0x02      // first byte of a slot holding inline data
+#define INLINE_SLOT_DATA 63   // data bytes per slot
+#define INLINE_MAX_SLOTS 4    // data slots per file, 252 bytes
+
+#define NODE_HEADER "\x01" // name of a node header, no real name
+#define NODE_ROOT 2     // first_blk is the root node
+#define NODE_LEAF 3     // first_blk is the next leaf, 0 after the last one
+#define NODE_INTERNAL 4 // first_blk is the child below the first key, size the number of keys
+
+// where a directory entry lives
+struct dir_slot {
+    unsigned dir_block; // first block of the directory
+    unsigned block_no;  // bucket holding the entry
+    unsigned index;
+};
+
+#define DENTRY_CACHE_MAX 65536 // cached names, across all directories
+
+// a cached lookup of a name in a directory, found == false remembers
+// that the name doesn't exist
+struct dentry {
+    bool found;
+    struct dir_entry entry;
+    struct dir_slot slot;
+};
+
+// An open file, see FS::open. The handle keeps where the entry lives and
+// the block the cursor is in, so reads and writes neither resolve the
+// path again nor walk the FAT chain from its start.
+struct open_file {
+    bool used;
+    uint8_t mode;           // READ and / or WRITE
+    struct dir_entry entry; // reloaded when a directory has changed
+    struct dir_slot slot;   // looked up again if the entry has moved
+    uint64_t dir_version;   // FS::dir_version when entry was loaded
+    uint32_t offset;        // the cursor
+    int32_t block;          // block of the chain at block_start, FAT_EOF if not known yet
+    uint32_t block_start;
+    int32_t last_block;     // last block of the chain, FAT_EOF if not known yet
+    uint32_t owned;         // leading blocks known not to be shared with a reflinked file
+};
+
+// the end of a file's chain, see FS::tails
+struct chain_tail {
+    int32_t block;
+    uint32_t owned; // as in open_file
+};
+
+// where a directory hangs in the tree, its parent and its name there
+struct dir_link {
+    unsigned parent;
+    std::string name;
 };
 
 class FS {
 private:
-    Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
+    std::unique_ptr<BlockDevice> device; // picked by the backend at construction
+    BlockCache cache;
+    // size of a FAT entry is 4 bytes, the FAT starts at FAT_BLOCK and
+    // covers as many blocks as the geometry needs
+    std::vector<int32_t> fat;
+    unsigned fat_blocks = 1;
+    std::vector<bool> fat_dirty; // FAT blocks changed since the last write_fat
+    bool fat_batch = false; // write_fat waits for the end of a bulk import
+    // blocks planned for a bulk import as one chain, handed out in order
+    std::vector<unsigned> batch_blocks;
+    size_t batch_next = 0;
+    FreeMap free_map; // free blocks, kept in step with the FAT by set_fat
+    // FAT links into each block, also kept by set_fat. A reflinked file
+    // shares all but the first block of its source, so a block with more
+    // than one link is shared, and so is the rest of the chain after it.
+    std::vector<uint32_t> block_refs;
+    size_t shared_blocks = 0; // blocks with more than one link
+    // first block of a file -> its last block and the leading blocks known
+    // not to be shared, so an append neither walks the chain to its end
+    // nor looks for shared blocks again. Only for chains that aren't shared
+    // at the end, set_fat forgets a tail once either end of its chain
+    // changes.
+    std::unordered_map<unsigned, struct chain_tail> tails;
+    std::unordered_map<unsigned, unsigned> tail_heads; // last block -> first block
+    // geometry of the mounted disk
+    unsigned block_size = DEFAULT_BLOCK_SIZE;
+    unsigned entries_per_block = DEFAULT_BLOCK_SIZE / sizeof(struct dir_entry);
     unsigned current_directory_block = ROOT_BLOCK;  // initially set to root block
+    // first block of a directory -> its buckets, filled from the FAT on use
+    std::unordered_map<unsigned, std::vector<unsigned>> dir_chains;
+    // first block of a directory -> name -> lookup result. Kept in step
+    // with the directory by dir_insert, dir_update and dir_split.
+    std::unordered_map<unsigned, std::unordered_map<std::string, struct dentry>> dentries;
+    size_t dentry_count = 0;
+    std::string dentry_key; // reused to look names up without allocating
+    size_t dentry_limit = DENTRY_CACHE_MAX; // 0 turns the cache off
+    uint64_t dentry_hits = 0;
+    uint64_t dentry_misses = 0;
+    size_t inline_limit = INLINE_MAX_SLOTS * INLINE_SLOT_DATA; // 0 turns inline files off
+    unsigned stream_ahead = STREAM_AHEAD; // 0 turns read-ahead off
+    bool tail_hints = true; // false walks a chain to its end on every append
+    // first block of a directory -> its parent and name, for pwd. Names
+    // are relative to the parent, so moving a directory updates one link.
+    std::unordered_map<unsigned, struct dir_link> dir_links;
+    std::vector<const std::string *> path_parts; // reused by dir_path
+    std::vector<struct open_file> handles; // open files, by descriptor
+    uint64_t dir_version = 0; // bumped by every change to a directory entry
+    unsigned walk_threads; // threads of find and du
+    bool mounted = false; // a file system of this layout is loaded
+
+    // per command counters and latencies, for the stats command
+    std::map<std::string, command_stats> commands;
+    bool in_command = false;
+    // times a command and charges the block I/O done meanwhile to it.
+    // Commands called by other commands are charged to the outer one.
+    class CommandScope {
+    private:
+        FS *fs;
+        command_stats *stats = nullptr;
+        std::chrono::steady_clock::time_point start;
+        uint64_t reads, writes, disk_reads, disk_writes;
+    public:
+        CommandScope(FS *fs, const char *name);
+        ~CommandScope();
+    };
 
 
 public:
-    FS();
+    FS(int disk_backend = DISK_FSTREAM, unsigned cache_blocks = CACHE_BLOCKS,
+       const std::string &disk_name = DISKNAME);
     ~FS();
-    // formats the disk, i.e., creates an empty file system
-    int format();
+    // mount reads the geometry and the FAT of the disk. It fails on a disk
+    // of an older layout or with a broken FAT, then only format works.
+    int mount();
+    bool is_mounted() { return mounted; }
+    // formats the disk, i.e., creates an empty file system. A non-zero
+    // no_blocks / block_size changes the geometry of the disk
+    int format(unsigned no_blocks = 0, unsigned block_size = 0);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
-    int create(std::string filepath);
+    int create(const std::string &filepath);
     // cat <filepath> reads the content of a file and prints it on the screen
-    int cat(std::string filepath);
-    // ls lists the content in the currect directory (files and sub-directories)
-    int ls();
+    int cat(const std::string &filepath);
+    // ls lists the content in the currect directory (files and sub-directories).
+    // In name order, only names starting with prefix and coming after
+    // after, at most count of them (0 for all)
+    int ls(const std::string &prefix = "", const std::string &after = "", unsigned count = 0);
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
-    // <sourcepath> to a new file <destpath>
-    int cp(std::string sourcepath, std::string destpath);
+    // <sourcepath> to a new file <destpath>. With reflink the copy shares
+    // the blocks of the source until either of them is written.
+    int cp(const std::string &sourcepath, const std::string &destpath, bool reflink = false);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
-    int mv(std::string sourcepath, std::string destpath);
-    // rm <filepath> removes / deletes the file <filepath>
-    int rm(std::string filepath);
+    int mv(const std::string &sourcepath, const std::string &destpath);
+    // rm <filepath> removes / deletes the file <filepath>, with recursive a
+    // directory and everything below it
+    int rm(const std::string &filepath, bool recursive = false);
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
-    int append(std::string filepath1, std::string filepath2);
+    int append(const std::string &filepath1, const std::string &filepath2);
+
+    // open returns a descriptor for the file <filepath>, for reading and /
+    // or writing (mode READ, WRITE) as its access rights allow, or -1. The
+    // cursor starts at 0. A handle doesn't follow the file through mv.
+    int open(const std::string &filepath, uint8_t mode);
+    // read copies up to count bytes at the cursor into buf and moves the
+    // cursor past them, returns the bytes read, 0 at the end of the file
+    int64_t read(int fd, uint8_t *buf, size_t count);
+    // write writes count bytes at the cursor, the file grows if they go
+    // past its end, and moves the cursor past them. Returns count or -1.
+    int64_t write(int fd, const uint8_t *buf, size_t count);
+    // seek moves the cursor to offset from the start, the cursor or the end
+    // (whence SEEK_SET, SEEK_CUR, SEEK_END), not past the end of the file.
+    // Returns the new cursor or -1.
+    int64_t seek(int fd, int64_t offset, int whence);
+    int close(int fd);
+
+    // import <hostpath> <fspath> copies the host file <hostpath> into a new
+    // file <fspath> (or into the directory <fspath>) as it is, in large
+    // chunks, and prints the throughput. With recursive <hostpath> is a
+    // directory, copied with everything below it in one batch.
+    int import_file(const std::string &hostpath, const std::string &fspath, bool recursive = false);
+    // export <fspath> <hostpath> copies the file <fspath> to the host file
+    // <hostpath>, replacing it, and prints the throughput
+    int export_file(const std::string &fspath, const std::string &hostpath);
 
     // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
-    // in the current directory
-    int mkdir(std::string dirpath);
+    // in the current directory, kept as a B+tree if btree is set
+    int mkdir(const std::string &dirpath, bool btree = false);
     // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
-    int cd(std::string dirpath);
+    int cd(const std::string &dirpath);
     // pwd prints the full path, i.e., from the root directory, to the current
     // directory, including the currect directory name
     int pwd();
+    // find <path> <pattern> prints the paths of everything below <path>
+    // whose name matches the shell pattern <pattern>
+    int find(const std::string &path, const std::string &pattern);
+    // du <path> prints the files, directories, bytes and blocks below <path>
+    int du(const std::string &path);
 
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
-    int chmod(std::string accessrights, std::string filepath);
+    int chmod(const std::string &accessrights, const std::string &filepath);
+
+    // sync makes everything written so far durable on the disk
+    int sync();
+    // cachestat prints the block cache counters
+    int cachestat();
+    // stats prints the device counters and, per command, the blocks it
+    // read and wrote and a latency histogram
+    int stats();
+    // stats reset clears the stats and the cache counters
+    int stats_reset();
 
-    std::string get_directory_name(unsigned block_no);
-    std::string recursive_pwd(unsigned block_no);
-    struct dir_entry* find_directory_entry(std::string name);
-    int find_directory_entry(const std::string& name, dir_entry* entries);
-    int find_free_directory_entry(dir_entry* entries);
+    // number of blocks (hash buckets) of a directory
+    unsigned get_dir_blocks(unsigned dir_block) { return dir_chain(dir_block).size(); }
+    // caps the number of cached lookups, 0 disables the dentry cache
+    void set_dentry_limit(size_t limit);
+    // caps the size of inline files, 0 stores every file in data blocks
+    void set_inline_limit(size_t limit) { inline_limit = limit; }
+    // chunks cp and append ask the disk to read ahead, 0 for none
+    void set_stream_ahead(unsigned chunks) { stream_ahead = chunks; }
+    // remembers the last block of appended files, off walks their chains
+    void set_tail_hints(bool on);
+    // threads of a tree walk, 0 for one per CPU
+    void set_walk_threads(unsigned threads);
+    unsigned get_walk_threads() { return walk_threads; }
+    unsigned get_free_blocks() { return free_map.get_free_blocks(); }
+    const struct dir_link *get_dir_link(unsigned dir_block);
+    int dir_path(unsigned dir_block, std::string &path);
+    int find_directory_entry(std::string_view name, dir_entry* entries);
+    int find_free_directory_entry(dir_entry* entries, unsigned count = 1);
+    void dir_compact(struct dir_entry *entries);
+    bool fits_inline(uint32_t size);
+    int read_inline(const struct dir_slot &slot, uint32_t size, std::vector<uint8_t> &data);
+    int import_tree(const std::string &hostpath, const std::string &fspath);
+    int import_data(int fd, uint32_t size, unsigned dir_block, std::string_view name, bool &in_kernel);
+    int import_chain(int fd, uint32_t size, const std::vector<unsigned> &blocks, bool &in_kernel);
+    int open_new(unsigned dir_block, std::string_view name, uint8_t access_rights);
+    int new_handle(const struct dir_entry &entry, const struct dir_slot &slot, uint8_t mode);
+    struct open_file *get_handle(int fd);
+    int handle_entry(struct open_file &h);
+    void handle_seek_block(struct open_file &h);
+    int write_inline(struct open_file &h, const uint8_t *buf, size_t count);
+    int stream(int source, int dest, size_t count, std::ostream *echo = nullptr);
     int find_free_fat_entry(int start_idx = 1);
-    int16_t findFreeBlock();
-    std::vector<std::string> resolve_path(std::string path);
-    std::vector<std::string> resolve_path_for_cp_and_mv(std::string path);
+    const std::vector<unsigned> &dir_chain(unsigned dir_block);
+    unsigned dir_bucket(unsigned dir_block, std::string_view name);
+    int dir_lookup(unsigned dir_block, std::string_view name, struct dir_entry &entry, struct dir_slot *slot = nullptr);
+    int dir_insert(unsigned dir_block, const struct dir_entry &entry, const uint8_t *data = nullptr,
+                   struct dir_slot *slot = nullptr);
+    int dir_update(const struct dir_slot &slot, const struct dir_entry &entry);
+    int dir_remove(const struct dir_slot &slot);
+    int dir_for_each(unsigned dir_block, const std::function<bool(const struct dir_entry &)> &fn);
+    int dir_split(unsigned dir_block);
+    int dir_grow(unsigned dir_block, unsigned &block_no);
+    bool dir_btree(unsigned dir_block);
+    unsigned btree_leaf(unsigned dir_block, std::string_view name, std::vector<unsigned> *path = nullptr);
+    int btree_split(unsigned dir_block, std::string_view name);
+    int btree_add_key(unsigned dir_block, std::vector<unsigned> &path, struct dir_entry key);
+    int dir_list(unsigned dir_block, std::string_view prefix, std::string_view after,
+                 const std::function<bool(const struct dir_entry &)> &fn);
+    void dir_forget(unsigned dir_block);
+    int dir_make(unsigned parent_block, std::string_view dirname, bool btree, unsigned &dir_block, bool start = true);
+    void dir_start(const std::vector<unsigned> &blocks, unsigned parent_block, bool btree);
+    void dentry_drop(unsigned dir_block);
+    void dentry_set(unsigned dir_block, std::string_view name, const struct dentry &d);
+    uint8_t dir_rights(unsigned dir_block);
+    void free_chain(unsigned first_blk);
+    int add_reflink(const struct dir_entry &source, unsigned dir_block, std::string_view name);
+    int unshare(struct open_file &h, uint32_t last);
+    void keep_tail(unsigned first_blk, int32_t last_block, uint32_t owned);
+    void drop_tail(unsigned block_no);
+    int collect_tree(unsigned dir_block, std::vector<unsigned> &dirs, std::vector<unsigned> &files);
+    void free_tree(const std::vector<unsigned> &dirs, const std::vector<unsigned> &files);
+    unsigned chain_blocks(unsigned first_blk) const;
+    int walk_tree(unsigned dir_block, const std::string &path,
+                  const std::function<void(unsigned, const std::string &, const struct dir_entry &)> &fn);
+    int allocate_chain(unsigned count, unsigned hint, std::vector<unsigned> &blocks);
+    int take_blocks(unsigned count, unsigned hint, std::vector<unsigned> &blocks);
+    int write_chain(const std::vector<unsigned> &blocks, uint8_t *data, size_t size);
+    void set_fat(unsigned block_no, int32_t value);
+    void build_free_map();
+    int write_fat();
+    int32_t findFreeBlock();
+    int walk_path(std::string_view path, unsigned &dir_block, std::string_view &name);
+    int walk_dir(std::string_view path, unsigned &dir_block);
+    bool name_fits(std::string_view name);
+    void set_entry_name(struct dir_entry &entry, std::string_view name);
 };
 
 #endif // __FS_H__
\ No newline at end of file
@@ -1,10 +1,31 @@
+#include <cstring>
+#include <cstdlib>
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
 
 int main(int argc, char **argv)
 {
-    Shell shell;
+    // the disk backend is chosen at startup, e.g. ./filesystem --mmap
+    int disk_backend = DISK_FSTREAM;
+    unsigned cache_blocks = CACHE_BLOCKS;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--mmap") == 0)
+            disk_backend = DISK_MMAP;
+        else if (strcmp(argv[i], "--uring") == 0)
+            disk_backend = DISK_URING;
+        else if (strcmp(argv[i], "--ram") == 0)
+            disk_backend = DISK_RAM;
+        else if (strcmp(argv[i], "--fstream") == 0)
+            disk_backend = DISK_FSTREAM;
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            cache_blocks = strtoul(argv[++i], nullptr, 10);
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--fstream | --mmap | --uring | --ram] [--cache <blocks>]\n";
+            return 1;
+        }
+    }
+    Shell shell(disk_backend, cache_blocks);
     shell.run();
     return 0;
 }
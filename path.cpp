@@ -0,0 +1,16 @@
+#include "path.h"
+
+bool PathIterator::next(std::string_view &part)
+{
+    while (pos < path.size())
+    {
+        size_t end = path.find('/', pos);
+        if (end == std::string_view::npos)
+            end = path.size();
+        part = path.substr(pos, end - pos);
+        pos = end + 1;
+        if (!part.empty() && part != ".")
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,21 @@
+#include <string_view>
+
+#ifndef __PATH_H__
+#define __PATH_H__
+
+// Walks the components of a path in place, without copying them. Empty
+// and "." components are skipped, ".." is handed out like any other name
+// and resolved by the directory's own ".." entry.
+class PathIterator {
+private:
+    std::string_view path;
+    size_t pos = 0;
+public:
+    explicit PathIterator(std::string_view path) : path(path) {}
+    // absolute paths start at the root, the others at the current directory
+    bool absolute() const { return !path.empty() && path[0] == '/'; }
+    // sets part to the next component, false at the end of the path
+    bool next(std::string_view &part);
+};
+
+#endif // __PATH_H__
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <cstring>
+#include "ramdisk.h"
+
+RamDisk::RamDisk()
+{
+    blocks.assign(get_disk_size(), 0);
+}
+
+bool
+RamDisk::valid_block(unsigned block_no, const char *op)
+{
+    if (block_no < no_blocks)
+        return true;
+    std::cout << "RamDisk::" << op << " - ERROR: Invalid block number (" << block_no << ")\n";
+    return false;
+}
+
+// recreates the device with a new geometry, the content is lost
+int
+RamDisk::resize(unsigned no_blocks, unsigned block_size)
+{
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        std::cout << "RamDisk::resize - ERROR: Invalid block size (" << block_size << ")\n";
+        return -1;
+    }
+    this->no_blocks = no_blocks;
+    this->block_size = block_size;
+    blocks.clear();
+    blocks.shrink_to_fit();
+    blocks.resize(get_disk_size(), 0);
+    return 0;
+}
+
+int
+RamDisk::write(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "write"))
+        return -1;
+    count_writes(1);
+    uint8_t *p = block_ptr(block_no);
+    if (p != blk)
+        memcpy(p, blk, block_size);
+    return 0;
+}
+
+int
+RamDisk::read(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "read"))
+        return -1;
+    count_reads(1);
+    memcpy(blk, block_ptr(block_no), block_size);
+    return 0;
+}
+
+// a copy out of memory, nothing is counted or printed
+int
+RamDisk::read_concurrent(unsigned block_no, uint8_t *blk)
+{
+    if (block_no >= no_blocks)
+        return -1;
+    memcpy(blk, block_ptr(block_no), block_size);
+    return 0;
+}
+
+int
+RamDisk::readv(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks)
+{
+    for (size_t i = 0; i < block_nos.size(); ++i) {
+        if (read(block_nos[i], blks[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int
+RamDisk::writev(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks)
+{
+    for (size_t i = 0; i < block_nos.size(); ++i) {
+        if (write(block_nos[i], blks[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+uint8_t *
+RamDisk::block_ptr(unsigned block_no)
+{
+    if (block_no >= no_blocks)
+        return nullptr;
+    return &blocks[(uint64_t)block_no * block_size];
+}
+
+// nothing to make durable, only counted
+int
+RamDisk::sync()
+{
+    flushes++;
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include "device.h"
+
+#ifndef __RAMDISK_H__
+#define __RAMDISK_H__
+
+// A block device held in memory, for measuring the file system without
+// file I/O and for running several file systems in one process.
+// Starts out zeroed with the default geometry, like a new disk file.
+class RamDisk : public BlockDevice {
+private:
+    std::vector<uint8_t> blocks;
+    bool valid_block(unsigned block_no, const char *op);
+public:
+    RamDisk();
+    int resize(unsigned no_blocks, unsigned block_size) override;
+    int write(unsigned block_no, uint8_t *blk) override;
+    int read(unsigned block_no, uint8_t *blk) override;
+    int read_concurrent(unsigned block_no, uint8_t *blk) override;
+    int readv(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks) override;
+    int writev(const std::vector<unsigned>& block_nos, const std::vector<uint8_t*>& blks) override;
+    uint8_t *block_ptr(unsigned block_no) override;
+    int sync() override;
+};
+
+#endif // __RAMDISK_H__
@@ -2,18 +2,20 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <cstdlib>
 #include "shell.h"
 #include "fs.h"
 
 std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
-    "mkdir", "cd", "pwd",
-    "chmod",
+    "mkdir", "cd", "pwd", "find", "du",
+    "import", "export",
+    "chmod", "sync", "cachestat", "stats",
     "help", "quit"
 };
 
-Shell::Shell()
+Shell::Shell(int disk_backend, unsigned cache_blocks) : filesystem(disk_backend, cache_blocks)
 {
     std::cout << "Starting shell...\n";
 }
@@ -65,13 +67,25 @@ Shell::run()
                 std::cout << "cmd/arg: " << cmd_line[i] << "\n";
         }
 
+        // without a file system only format gets through
+        if (!filesystem.is_mounted() && !cmd.empty() && cmd != "format" && cmd != "help" && cmd != "quit") {
+            std::cout << "No file system on the disk, run format first.\n";
+            continue;
+        }
+
         if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
+            if (cmd_line.size() > 3) {
+                std::cout << "Usage: format [<no_blocks> [<block_size>]]\n";
                 continue;
             }
+            // the geometry defaults to the current one
+            unsigned no_blocks = 0, block_size = 0;
+            if (cmd_line.size() > 1)
+                no_blocks = strtoul(cmd_line[1].c_str(), nullptr, 10);
+            if (cmd_line.size() > 2)
+                block_size = strtoul(cmd_line[2].c_str(), nullptr, 10);
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            ret_val = filesystem.format(no_blocks, block_size);
             if (ret_val) {
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
             }
@@ -107,26 +121,41 @@ Shell::run()
         }
 
         else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
+            // options come in pairs, each with its value
+            std::string prefix, after;
+            unsigned count = 0;
+            bool usage = cmd_line.size() % 2 == 0;
+            for (unsigned i = 1; !usage && i < cmd_line.size(); i += 2) {
+                if (cmd_line[i] == "-p")
+                    prefix = cmd_line[i + 1];
+                else if (cmd_line[i] == "-a")
+                    after = cmd_line[i + 1];
+                else if (cmd_line[i] == "-n")
+                    count = strtoul(cmd_line[i + 1].c_str(), nullptr, 10);
+                else
+                    usage = true;
+            }
+            if (usage) {
+                std::cout << "Usage: ls [-p <prefix>] [-a <after>] [-n <count>]\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.ls();
+            ret_val = filesystem.ls(prefix, after, count);
             if (ret_val) {
                 std::cout << "Error: ls failed, error code " << ret_val << std::endl;
             }
         }
 
         else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
+            bool reflink = cmd_line.size() == 4 && cmd_line[1] == "--reflink";
+            if (cmd_line.size() != 3 && !reflink) {
+                std::cout << "Usage: cp [--reflink] <oldfile> <newfile>\n";
                 continue;
             }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
+            arg1 = cmd_line[cmd_line.size() - 2];
+            arg2 = cmd_line.back();
             // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
+            ret_val = filesystem.cp(arg1, arg2, reflink);
             if (ret_val) {
                 std::cout << "Error: cp " << arg1 << " " << arg2;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -149,13 +178,14 @@ Shell::run()
         }
 
         else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
+            bool recursive = cmd_line.size() == 3 && cmd_line[1] == "-r";
+            if (cmd_line.size() != 2 && !recursive) {
+                std::cout << "Usage: rm [-r] <file>\n";
                 continue;
             }
-            arg1 = cmd_line[1];
+            arg1 = cmd_line.back();
             // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
+            ret_val = filesystem.rm(arg1, recursive);
             if (ret_val) {
                 std::cout << "Error: rm " << arg1;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -178,13 +208,14 @@ Shell::run()
         }
 
         else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
+            bool btree = cmd_line.size() == 3 && cmd_line[1] == "--btree";
+            if (cmd_line.size() != 2 && !btree) {
+                std::cout << "Usage: mkdir [--btree] <dirpath>\n";
                 continue;
             }
-            arg1 = cmd_line[1];
+            arg1 = cmd_line.back();
             // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
+            ret_val = filesystem.mkdir(arg1, btree);
             if (ret_val) {
                 std::cout << "Error: mkdir " << arg1;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -217,6 +248,66 @@ Shell::run()
             }
         }
 
+        else if (cmd == "find") {
+            if (cmd_line.size() != 3) {
+                std::cout << "Usage: find <path> <pattern>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            arg2 = cmd_line[2];
+            // check return value so everything is ok
+            ret_val = filesystem.find(arg1, arg2);
+            if (ret_val) {
+                std::cout << "Error: find " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "du") {
+            if (cmd_line.size() != 2) {
+                std::cout << "Usage: du <path>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            // check return value so everything is ok
+            ret_val = filesystem.du(arg1);
+            if (ret_val) {
+                std::cout << "Error: du " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "import") {
+            bool recursive = cmd_line.size() == 4 && cmd_line[1] == "-r";
+            if (cmd_line.size() != 3 && !recursive) {
+                std::cout << "Usage: import [-r] <hostpath> <fspath>\n";
+                continue;
+            }
+            arg1 = cmd_line[cmd_line.size() - 2];
+            arg2 = cmd_line.back();
+            // check return value so everything is ok
+            ret_val = filesystem.import_file(arg1, arg2, recursive);
+            if (ret_val) {
+                std::cout << "Error: import " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "export") {
+            if (cmd_line.size() != 3) {
+                std::cout << "Usage: export <fspath> <hostpath>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            arg2 = cmd_line[2];
+            // check return value so everything is ok
+            ret_val = filesystem.export_file(arg1, arg2);
+            if (ret_val) {
+                std::cout << "Error: export " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "chmod") {
             if (cmd_line.size() != 3) {
                 std::cout << "Usage: chmod <accessrights> <filepath>\n";
@@ -232,12 +323,51 @@ Shell::run()
             }
         }
 
+        else if (cmd == "sync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "cachestat") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: cachestat\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.cachestat();
+            if (ret_val) {
+                std::cout << "Error: cachestat failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "stats") {
+            if (cmd_line.size() == 1)
+                ret_val = filesystem.stats();
+            else if (cmd_line.size() == 2 && cmd_line[1] == "reset")
+                ret_val = filesystem.stats_reset();
+            else {
+                std::cout << "Usage: stats [reset]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            if (ret_val) {
+                std::cout << "Error: stats failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "quit")
             running = false;
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, find, du, import, export, chmod, sync, cachestat, stats, help, quit\n";
         }
 
         else if (cmd == "") {
@@ -246,7 +376,7 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, find, du, import, export, chmod, sync, cachestat, stats, help, quit\n";
         }
     }
 }
@@ -8,7 +8,7 @@ class Shell {
 private:
     FS filesystem;
 public:
-    Shell();
+    Shell(int disk_backend = DISK_FSTREAM, unsigned cache_blocks = CACHE_BLOCKS);
     ~Shell();
     void run();
 };
@@ -0,0 +1,66 @@
+#include <cstdio>
+#include "stats.h"
+
+void LatencyHistogram::record(uint64_t ns)
+{
+    unsigned bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    buckets[bucket]++;
+    count++;
+    total_ns += ns;
+    if (ns > max_ns)
+        max_ns = ns;
+}
+
+void LatencyHistogram::reset()
+{
+    for (uint64_t &bucket : buckets)
+        bucket = 0;
+    count = total_ns = max_ns = 0;
+}
+
+// upper bound of the bucket holding the p-th fraction of the calls
+uint64_t LatencyHistogram::percentile_ns(double p)
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = p * count;
+    if (rank >= count)
+        rank = count - 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen > rank)
+            return 2ULL << i;
+    }
+    return max_ns;
+}
+
+// prints the non-empty buckets on one line
+void LatencyHistogram::print(std::ostream &out)
+{
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        if (buckets[i] == 0)
+            continue;
+        out << " <" << format_ns(2ULL << i) << ":" << buckets[i];
+    }
+    out << "\n";
+}
+
+// formats a duration with a unit that fits it, e.g. 12.5us
+std::string format_ns(uint64_t ns)
+{
+    char buf[32];
+    if (ns < 1000)
+        snprintf(buf, sizeof(buf), "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, sizeof(buf), "%.1fs", ns / 1e9);
+    return buf;
+}
@@ -0,0 +1,43 @@
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#define HISTOGRAM_BUCKETS 40 // bucket i holds [2^i, 2^(i+1)) ns
+
+// Latency histogram with power-of-two buckets, cheap enough to record
+// every call.
+class LatencyHistogram {
+private:
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+public:
+    void record(uint64_t ns);
+    void reset();
+    uint64_t get_count() { return count; }
+    uint64_t get_max_ns() { return max_ns; }
+    uint64_t mean_ns() { return count ? total_ns / count : 0; }
+    // upper bound of the bucket holding the p-th fraction of the calls
+    uint64_t percentile_ns(double p);
+    // prints the non-empty buckets on one line
+    void print(std::ostream& out);
+};
+
+// formats a duration with a unit that fits it, e.g. 12.5us
+std::string format_ns(uint64_t ns);
+
+// counters of one FS command
+struct command_stats {
+    uint64_t calls = 0;
+    uint64_t reads = 0;       // blocks read through the cache
+    uint64_t writes = 0;      // blocks written through the cache
+    uint64_t disk_reads = 0;  // blocks read from the device
+    uint64_t disk_writes = 0; // blocks written to the device
+    LatencyHistogram latency;
+};
+
+#endif // __STATS_H__
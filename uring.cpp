@@ -0,0 +1,177 @@
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+IoUring::~IoUring()
+{
+    teardown();
+}
+
+// creates the rings, returns -1 if io_uring isn't available
+int
+IoUring::setup(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = io_uring_setup(entries, &p);
+    if (ring_fd < 0)
+        return -1;
+    this->entries = p.sq_entries;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sq = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    void *cq = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    void *s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    sq_ring = (sq == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(sq);
+    cq_ring = (cq == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(cq);
+    sqes = (s == MAP_FAILED) ? nullptr : static_cast<struct io_uring_sqe*>(s);
+    if (!sq_ring || !cq_ring || !sqes) {
+        teardown();
+        return -1;
+    }
+
+    sq_head = (unsigned*)(sq_ring + p.sq_off.head);
+    sq_tail = (unsigned*)(sq_ring + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq_ring + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq_ring + p.sq_off.array);
+    cq_head = (unsigned*)(cq_ring + p.cq_off.head);
+    cq_tail = (unsigned*)(cq_ring + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq_ring + p.cq_off.cqes);
+    queued = 0;
+    return 0;
+}
+
+void
+IoUring::teardown()
+{
+    if (sq_ring)
+        munmap(sq_ring, sq_ring_size);
+    if (cq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sqes)
+        munmap(sqes, sqes_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+    sq_ring = cq_ring = nullptr;
+    sqes = nullptr;
+    ring_fd = -1;
+    entries = queued = 0;
+}
+
+// queues a preadv/pwritev, returns -1 if the submission ring is full
+int
+IoUring::queue(bool write, int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t user_data)
+{
+    if (queued == entries)
+        return -1;
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = count;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    sq_array[index] = index;
+    // the kernel may only see the new tail once the entry is filled in
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return 0;
+}
+
+// queues an fdatasync of fd, returns -1 if the submission ring is full
+int
+IoUring::queue_fsync(int fd, uint64_t user_data)
+{
+    if (queued == entries)
+        return -1;
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return 0;
+}
+
+// moves the completions in the ring to done
+void
+IoUring::reap(std::vector<completion>& done)
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        done.push_back({cqe->user_data, cqe->res});
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// submits everything queued and waits until all of it has completed
+int
+IoUring::submit_and_wait(std::vector<completion>& done)
+{
+    done.clear();
+    unsigned to_submit = queued;
+    while (to_submit > 0 || done.size() < queued) {
+        unsigned wait = queued - done.size();
+        int ret = io_uring_enter(ring_fd, to_submit, wait, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            abandon(done);
+            return -1;
+        }
+        to_submit -= ret;
+        reap(done);
+    }
+    queued = 0;
+    return 0;
+}
+
+// after a failed io_uring_enter, leaves the ring empty for the next batch:
+// the entries the kernel hasn't taken are dropped from the submission
+// ring and the ones it has are waited for. If even that fails the ring is
+// torn down, the disk then goes on with preadv/pwritev.
+void
+IoUring::abandon(std::vector<completion>& done)
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned taken = queued - (*sq_tail - head);
+    __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+    reap(done);
+    while (done.size() < taken) {
+        if (io_uring_enter(ring_fd, 0, taken - done.size(), IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            teardown();
+            return;
+        }
+        reap(done);
+    }
+    queued = 0;
+}
@@ -0,0 +1,52 @@
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#define URING_ENTRIES 64 // requests in flight per submission
+
+// Minimal io_uring on the raw system calls, no liburing needed.
+// Requests are queued into the submission ring and handed to the kernel
+// in one io_uring_enter, which also waits for all of their completions.
+class IoUring {
+private:
+    int ring_fd = -1;
+    unsigned entries = 0;
+    unsigned queued = 0;
+    // submission ring
+    uint8_t *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+    // completion ring
+    uint8_t *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+public:
+    struct completion {
+        uint64_t user_data;
+        int32_t res; // bytes transferred or -errno
+    };
+    ~IoUring();
+    // creates the rings, returns -1 if io_uring isn't available
+    int setup(unsigned entries = URING_ENTRIES);
+    void teardown();
+    bool active() { return ring_fd >= 0; }
+    unsigned get_entries() { return entries; }
+    // queues a preadv/pwritev, returns -1 if the submission ring is full
+    int queue(bool write, int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t user_data);
+    // queues an fdatasync of fd, returns -1 if the submission ring is full
+    int queue_fsync(int fd, uint64_t user_data);
+    // submits everything queued and waits until all of it has completed
+    int submit_and_wait(std::vector<completion>& done);
+private:
+    void reap(std::vector<completion>& done);
+    void abandon(std::vector<completion>& done);
+};
+
+#endif // __URING_H__
@@ -0,0 +1,76 @@
+#include <thread>
+#include "walker.h"
+
+TreeWalker::TreeWalker(unsigned threads)
+{
+    if (threads == 0)
+        threads = 1;
+    if (threads > WALK_THREADS_MAX)
+        threads = WALK_THREADS_MAX;
+    for (unsigned i = 0; i < threads; ++i)
+        workers.push_back(std::make_unique<worker>());
+}
+
+void TreeWalker::push(unsigned self, struct walk_task task)
+{
+    // counted before it can be taken, so pending can't hit zero early
+    pending++;
+    std::lock_guard<std::mutex> guard(workers[self]->lock);
+    workers[self]->tasks.push_back(std::move(task));
+}
+
+// take gets the newest task of worker self, or steals the oldest one of
+// the next worker that has any
+bool TreeWalker::take(unsigned self, struct walk_task &task)
+{
+    {
+        std::lock_guard<std::mutex> guard(workers[self]->lock);
+        if (!workers[self]->tasks.empty())
+        {
+            task = std::move(workers[self]->tasks.back());
+            workers[self]->tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i)
+    {
+        worker &victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TreeWalker::work(unsigned self, const visit_fn &visit)
+{
+    struct walk_task task;
+    while (pending > 0)
+    {
+        if (!take(self, task))
+        {
+            // the other workers may still push more
+            std::this_thread::yield();
+            continue;
+        }
+        visit(*this, self, task);
+        // after the visit, which pushed the subdirectories
+        pending--;
+    }
+}
+
+void TreeWalker::run(struct walk_task root, const visit_fn &visit)
+{
+    push(0, std::move(root));
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < workers.size(); ++i)
+        threads.emplace_back(&TreeWalker::work, this, i, std::cref(visit));
+    work(0, visit);
+    for (std::thread &t : threads)
+        t.join();
+}
@@ -0,0 +1,49 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+#ifndef __WALKER_H__
+#define __WALKER_H__
+
+#define WALK_THREADS_MAX 16 // threads a walk uses at most
+
+// a directory still to be walked, with its path for the results
+struct walk_task {
+    unsigned dir_block;
+    std::string path;
+};
+
+// Walks a tree of directories on a pool of threads with work stealing.
+// Every worker keeps its own deque: it pushes the directories it finds at
+// the back and takes the newest one from there, depth first, and a worker
+// that runs dry steals the oldest one from another worker, the top of a
+// large subtree. run() returns once every directory has been visited.
+class TreeWalker {
+private:
+    struct worker {
+        std::mutex lock;
+        std::deque<struct walk_task> tasks;
+    };
+    std::vector<std::unique_ptr<worker>> workers;
+    std::atomic<size_t> pending{0}; // pushed and not yet visited
+    std::atomic<uint64_t> steals{0};
+    using visit_fn = std::function<void(TreeWalker &, unsigned, const struct walk_task &)>;
+    bool take(unsigned self, struct walk_task &task);
+    void work(unsigned self, const visit_fn &visit);
+public:
+    explicit TreeWalker(unsigned threads);
+    unsigned get_threads() const { return workers.size(); }
+    uint64_t get_steals() const { return steals; }
+    // queues a directory found by worker self
+    void push(unsigned self, struct walk_task task);
+    // visits root and everything visit pushes, visit gets the walker and
+    // the number of the worker calling it. The caller is worker 0.
+    void run(struct walk_task root, const visit_fn &visit);
+};
+
+#endif // __WALKER_H__